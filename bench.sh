@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# Runs the capture -> commit -> flip pipeline on vivid and vkms, so no
+# camera nor display is needed, across a matrix of capture sizes,
+# formats, buffer counts and present modes. The stats of every run go
+# to one JSON file, for CI to compare against previous results.
+#
+# Space separated lists override the matrix:
+#   BENCH_SIZES, BENCH_FORMATS, BENCH_BUFFERS, BENCH_MODES
+# and
+#   BENCH_SECONDS  length of each run (default 5)
+#   BENCH_ARGS     passed to every run, e.g. "-t -w 2"
+#   BENCH_OUT      results (default bench.json)
+#   BENCH_LOGS     output of each run (default bench-logs)
+#
+# Loading the modules needs root, later runs can do without.
+
+SIZES=${BENCH_SIZES:-"640x480 1280x720 1920x1080"}
+FORMATS=${BENCH_FORMATS:-"YUYV NV12"}
+BUFFERS=${BENCH_BUFFERS:-"3 4"}
+MODES=${BENCH_MODES:-"fifo mailbox"}
+RUN_SECONDS=${BENCH_SECONDS:-5}
+ARGS=${BENCH_ARGS:-}
+OUT=${BENCH_OUT:-bench.json}
+LOGS=${BENCH_LOGS:-bench-logs}
+TEST=${BENCH_TEST:-./test}
+
+# The capture node of the first vivid instance
+find_video()
+{
+	for d in /sys/class/video4linux/video*; do
+		[ -r "$d/name" ] || continue
+		case "$(cat "$d/name")" in
+		vivid-*-vid-cap)
+			echo "/dev/${d##*/}"
+			return 0
+			;;
+		esac
+	done
+	return 1
+}
+
+# The card vkms registered, the device is named after the driver
+find_card()
+{
+	for d in /sys/class/drm/card[0-9]*; do
+		case "${d##*/}" in
+		*-*)
+			continue	# connectors, e.g. card1-Virtual-1
+			;;
+		esac
+		dev=$(readlink -f "$d/device")
+		if [ "${dev##*/}" = vkms ]; then
+			echo "/dev/dri/${d##*/}"
+			return 0
+		fi
+	done
+	return 1
+}
+
+VIDEO=$(find_video || { modprobe vivid && sleep 1 && find_video; })
+CARD=$(find_card || { modprobe vkms && sleep 1 && find_card; })
+if [ -z "$VIDEO" ] || [ -z "$CARD" ]; then
+	echo "bench: needs the vivid and vkms modules" >&2
+	exit 1
+fi
+echo "bench: capturing from $VIDEO, showing on $CARD"
+
+mkdir -p "$LOGS" || exit 1
+run=0
+failed=0
+
+echo '{' > "$OUT"
+echo "  \"video\": \"$VIDEO\", \"card\": \"$CARD\", \"kernel\": \"$(uname -r)\"," >> "$OUT"
+echo '  "runs": [' >> "$OUT"
+
+for size in $SIZES; do
+for format in $FORMATS; do
+for buffers in $BUFFERS; do
+for mode in $MODES; do
+	run=$((run + 1))
+	name="$size-$format-$buffers-$mode"
+	json="$LOGS/$name.json"
+	rm -f "$json"
+
+	# shellcheck disable=SC2086
+	if "$TEST" -q -v "$VIDEO" -D "$CARD" -s "$size" -F "$format" \
+			-n "$buffers" -p "$mode" -d "$RUN_SECONDS" -j "$json" \
+			$ARGS > "$LOGS/$name.log" 2>&1 && [ -s "$json" ]; then
+		ok=true
+		echo "bench: $name done"
+	else
+		ok=false
+		failed=$((failed + 1))
+		echo "bench: $name failed, see $LOGS/$name.log" >&2
+	fi
+
+	[ $run -gt 1 ] && echo '    ,' >> "$OUT"
+	{
+		echo "    { \"size\": \"$size\", \"format\": \"$format\","
+		echo "      \"buffers\": $buffers, \"present_mode\": \"$mode\","
+		echo "      \"ok\": $ok, \"stats\":"
+		if $ok; then
+			sed 's/^/      /' "$json"
+		else
+			echo '      null'
+		fi
+		echo '    }'
+	} >> "$OUT"
+done
+done
+done
+done
+
+echo '  ]' >> "$OUT"
+echo '}' >> "$OUT"
+
+echo "bench: $run runs, $failed failed, results in $OUT"
+[ $failed -eq 0 ]
@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+/*
+ * BT.601 limited range YUV to RGB, in fixed point with 6 fractional
+ * bits so that the SIMD kernels work on 16-bit lanes:
+ *
+ *   R = (75 (Y - 16) + 102 (V - 128) + 32) >> 6
+ *   G = (75 (Y - 16) -  25 (U - 128) - 52 (V - 128) + 32) >> 6
+ *   B = (75 (Y - 16) + 129 (U - 128) + 32) >> 6
+ *
+ * Only the sums for B may overflow 16 bits, when the result is far
+ * above 255 anyway, so saturating adds keep every kernel bit-exact
+ * with the scalar one.
+ */
+#define Y_COEF		75
+#define V_TO_R		102
+#define U_TO_G		25
+#define V_TO_G		52
+#define U_TO_B		129
+#define ROUND		32
+
+/*
+ * Every source format is horizontally subsampled by 2, so the kernels
+ * convert a row of luma plus a row of interleaved chroma, U0 V0 U1 V1,
+ * like NV12 and NV16 have them. Packed formats are split first.
+ */
+struct convert_kernels {
+	const char *name;
+	int (*supported)(void);
+	void (*split)(const uint8_t *src, uint8_t *y, uint8_t *uv,
+			int width, int y_offset);
+	void (*to_xrgb)(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+			int width);
+	void (*to_rgb565)(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+			int width);
+};
+
+static inline uint8_t clamp8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void yuv_to_rgb(int y, int u, int v,
+		uint8_t *r, uint8_t *g, uint8_t *b)
+{
+	int yc = (y - 16) * Y_COEF + ROUND, d = u - 128, e = v - 128;
+
+	*r = clamp8((yc + V_TO_R * e) >> 6);
+	*g = clamp8((yc - U_TO_G * d - V_TO_G * e) >> 6);
+	*b = clamp8((yc + U_TO_B * d) >> 6);
+}
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+static void split_c(const uint8_t *src, uint8_t *y, uint8_t *uv,
+		int width, int y_offset)
+{
+	int x;
+
+	for (x = 0; x < width; x++) {
+		y[x] = src[2 * x + y_offset];
+		uv[x] = src[2 * x + 1 - y_offset];
+	}
+}
+
+static void row_xrgb_c(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+		int width)
+{
+	int x;
+
+	/* XRGB8888 is B, G, R, X in memory */
+	for (x = 0; x < width; x++) {
+		yuv_to_rgb(y[x], uv[x & ~1], uv[x | 1],
+			&dst[4 * x + 2], &dst[4 * x + 1], &dst[4 * x]);
+		dst[4 * x + 3] = 0xff;
+	}
+}
+
+static void row_rgb565_c(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+		int width)
+{
+	uint16_t *out = (uint16_t *)dst;
+	uint8_t r, g, b;
+	int x;
+
+	for (x = 0; x < width; x++) {
+		yuv_to_rgb(y[x], uv[x & ~1], uv[x | 1], &r, &g, &b);
+		out[x] = (r & 0xf8) << 8 | (g & 0xfc) << 3 | b >> 3;
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+#define TARGET_SSE4 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+static int sse4_supported(void)
+{
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* 8 pixels: y and uv are zero-extended to 16 bits, r, g, b are clamped */
+TARGET_SSE4 static inline void yuv_to_rgb_sse4(__m128i y, __m128i uv,
+		__m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i u_dup = _mm_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5,
+			8, 9, 8, 9, 12, 13, 12, 13);
+	const __m128i v_dup = _mm_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7,
+			10, 11, 10, 11, 14, 15, 14, 15);
+	const __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+	__m128i yc, d, e, t;
+
+	yc = _mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)),
+			_mm_set1_epi16(Y_COEF));
+	yc = _mm_add_epi16(yc, _mm_set1_epi16(ROUND));
+	uv = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+	d = _mm_shuffle_epi8(uv, u_dup);
+	e = _mm_shuffle_epi8(uv, v_dup);
+
+	t = _mm_adds_epi16(yc, _mm_mullo_epi16(e, _mm_set1_epi16(V_TO_R)));
+	*r = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(t, 6), zero), max);
+	t = _mm_sub_epi16(yc, _mm_mullo_epi16(d, _mm_set1_epi16(U_TO_G)));
+	t = _mm_sub_epi16(t, _mm_mullo_epi16(e, _mm_set1_epi16(V_TO_G)));
+	*g = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(t, 6), zero), max);
+	t = _mm_adds_epi16(yc, _mm_mullo_epi16(d, _mm_set1_epi16(U_TO_B)));
+	*b = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(t, 6), zero), max);
+}
+
+TARGET_SSE4 static void split_sse4(const uint8_t *src, uint8_t *y, uint8_t *uv,
+		int width, int y_offset)
+{
+	const __m128i yuyv = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+			1, 3, 5, 7, 9, 11, 13, 15);
+	const __m128i uyvy = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15,
+			0, 2, 4, 6, 8, 10, 12, 14);
+	const __m128i mask = y_offset ? uyvy : yuyv;
+	__m128i v;
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+		v = _mm_shuffle_epi8(v, mask);
+		_mm_storel_epi64((__m128i *)(y + x), v);
+		_mm_storel_epi64((__m128i *)(uv + x), _mm_srli_si128(v, 8));
+	}
+	split_c(src + 2 * x, y + x, uv + x, width - x, y_offset);
+}
+
+TARGET_SSE4 static void row_xrgb_sse4(const uint8_t *y, const uint8_t *uv,
+		uint8_t *dst, int width)
+{
+	const __m128i alpha = _mm_set1_epi16((short)0xff00);
+	__m128i r, g, b, bg, ra;
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		yuv_to_rgb_sse4(
+			_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(y + x))),
+			_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(uv + x))),
+			&r, &g, &b);
+		bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		ra = _mm_or_si128(r, alpha);
+		_mm_storeu_si128((__m128i *)(dst + 4 * x), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)(dst + 4 * x + 16), _mm_unpackhi_epi16(bg, ra));
+	}
+	row_xrgb_c(y + x, uv + x, dst + 4 * x, width - x);
+}
+
+TARGET_SSE4 static void row_rgb565_sse4(const uint8_t *y, const uint8_t *uv,
+		uint8_t *dst, int width)
+{
+	__m128i r, g, b, p;
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		yuv_to_rgb_sse4(
+			_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(y + x))),
+			_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(uv + x))),
+			&r, &g, &b);
+		p = _mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xf8)), 8);
+		p = _mm_or_si128(p, _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xfc)), 3));
+		p = _mm_or_si128(p, _mm_srli_epi16(b, 3));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), p);
+	}
+	row_rgb565_c(y + x, uv + x, dst + 2 * x, width - x);
+}
+
+/*
+ * 16 pixels, 0-7 in the low 128-bit lane and 8-15 in the high one,
+ * so that the in-lane chroma shuffles of the SSE version still work.
+ */
+TARGET_AVX2 static inline void yuv_to_rgb_avx2(__m256i y, __m256i uv,
+		__m256i *r, __m256i *g, __m256i *b)
+{
+	const __m256i u_dup = _mm256_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5,
+			8, 9, 8, 9, 12, 13, 12, 13, 0, 1, 0, 1, 4, 5, 4, 5,
+			8, 9, 8, 9, 12, 13, 12, 13);
+	const __m256i v_dup = _mm256_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7,
+			10, 11, 10, 11, 14, 15, 14, 15, 2, 3, 2, 3, 6, 7, 6, 7,
+			10, 11, 10, 11, 14, 15, 14, 15);
+	const __m256i zero = _mm256_setzero_si256(), max = _mm256_set1_epi16(255);
+	__m256i yc, d, e, t;
+
+	yc = _mm256_mullo_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(16)),
+			_mm256_set1_epi16(Y_COEF));
+	yc = _mm256_add_epi16(yc, _mm256_set1_epi16(ROUND));
+	uv = _mm256_sub_epi16(uv, _mm256_set1_epi16(128));
+	d = _mm256_shuffle_epi8(uv, u_dup);
+	e = _mm256_shuffle_epi8(uv, v_dup);
+
+	t = _mm256_adds_epi16(yc, _mm256_mullo_epi16(e, _mm256_set1_epi16(V_TO_R)));
+	*r = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(t, 6), zero), max);
+	t = _mm256_sub_epi16(yc, _mm256_mullo_epi16(d, _mm256_set1_epi16(U_TO_G)));
+	t = _mm256_sub_epi16(t, _mm256_mullo_epi16(e, _mm256_set1_epi16(V_TO_G)));
+	*g = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(t, 6), zero), max);
+	t = _mm256_adds_epi16(yc, _mm256_mullo_epi16(d, _mm256_set1_epi16(U_TO_B)));
+	*b = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(t, 6), zero), max);
+}
+
+TARGET_AVX2 static void split_avx2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+		int width, int y_offset)
+{
+	const __m256i yuyv = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+			1, 3, 5, 7, 9, 11, 13, 15, 0, 2, 4, 6, 8, 10, 12, 14,
+			1, 3, 5, 7, 9, 11, 13, 15);
+	const __m256i uyvy = _mm256_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15,
+			0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+			0, 2, 4, 6, 8, 10, 12, 14);
+	const __m256i mask = y_offset ? uyvy : yuyv;
+	__m256i v;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(src + 2 * x));
+		/* Y 0-7, UV 0-7, Y 8-15, UV 8-15 -> Y 0-15, UV 0-15 */
+		v = _mm256_shuffle_epi8(v, mask);
+		v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i *)(y + x), _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(uv + x), _mm256_extracti128_si256(v, 1));
+	}
+	split_c(src + 2 * x, y + x, uv + x, width - x, y_offset);
+}
+
+TARGET_AVX2 static void row_xrgb_avx2(const uint8_t *y, const uint8_t *uv,
+		uint8_t *dst, int width)
+{
+	const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+	__m256i r, g, b, bg, ra, lo, hi;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		yuv_to_rgb_avx2(
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + x))),
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(uv + x))),
+			&r, &g, &b);
+		bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+		ra = _mm256_or_si256(r, alpha);
+		/* pixels 0-3 and 8-11, then 4-7 and 12-15 */
+		lo = _mm256_unpacklo_epi16(bg, ra);
+		hi = _mm256_unpackhi_epi16(bg, ra);
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x),
+				_mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x + 32),
+				_mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	row_xrgb_c(y + x, uv + x, dst + 4 * x, width - x);
+}
+
+TARGET_AVX2 static void row_rgb565_avx2(const uint8_t *y, const uint8_t *uv,
+		uint8_t *dst, int width)
+{
+	__m256i r, g, b, p;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		yuv_to_rgb_avx2(
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + x))),
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(uv + x))),
+			&r, &g, &b);
+		p = _mm256_slli_epi16(_mm256_and_si256(r, _mm256_set1_epi16(0xf8)), 8);
+		p = _mm256_or_si256(p, _mm256_slli_epi16(_mm256_and_si256(g, _mm256_set1_epi16(0xfc)), 3));
+		p = _mm256_or_si256(p, _mm256_srli_epi16(b, 3));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * x), p);
+	}
+	row_rgb565_c(y + x, uv + x, dst + 2 * x, width - x);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+
+/* 8 pixels, saturating narrowing does the clamping */
+static inline void yuv_to_rgb_neon(uint8x8_t y, uint8x8_t u, uint8x8_t v,
+		uint8x8_t *r, uint8x8_t *g, uint8x8_t *b)
+{
+	int16x8_t yc, d, e;
+
+	yc = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y)), vdupq_n_s16(16));
+	yc = vaddq_s16(vmulq_n_s16(yc, Y_COEF), vdupq_n_s16(ROUND));
+	d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u)), vdupq_n_s16(128));
+	e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)), vdupq_n_s16(128));
+
+	*r = vqmovun_s16(vshrq_n_s16(vqaddq_s16(yc, vmulq_n_s16(e, V_TO_R)), 6));
+	*g = vqmovun_s16(vshrq_n_s16(vsubq_s16(vsubq_s16(yc,
+			vmulq_n_s16(d, U_TO_G)), vmulq_n_s16(e, V_TO_G)), 6));
+	*b = vqmovun_s16(vshrq_n_s16(vqaddq_s16(yc, vmulq_n_s16(d, U_TO_B)), 6));
+}
+
+static void split_neon(const uint8_t *src, uint8_t *y, uint8_t *uv,
+		int width, int y_offset)
+{
+	uint8x16x2_t v;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		v = vld2q_u8(src + 2 * x);
+		vst1q_u8(y + x, v.val[y_offset]);
+		vst1q_u8(uv + x, v.val[1 - y_offset]);
+	}
+	split_c(src + 2 * x, y + x, uv + x, width - x, y_offset);
+}
+
+static void row_xrgb_neon(const uint8_t *y, const uint8_t *uv,
+		uint8_t *dst, int width)
+{
+	uint8x8x2_t c, u, v;
+	uint8x8x4_t px;
+	uint8x16_t l;
+	int x;
+
+	px.val[3] = vdup_n_u8(0xff);
+	for (x = 0; x + 16 <= width; x += 16) {
+		l = vld1q_u8(y + x);
+		c = vld2_u8(uv + x);
+		u = vzip_u8(c.val[0], c.val[0]);
+		v = vzip_u8(c.val[1], c.val[1]);
+
+		yuv_to_rgb_neon(vget_low_u8(l), u.val[0], v.val[0],
+				&px.val[2], &px.val[1], &px.val[0]);
+		vst4_u8(dst + 4 * x, px);
+		yuv_to_rgb_neon(vget_high_u8(l), u.val[1], v.val[1],
+				&px.val[2], &px.val[1], &px.val[0]);
+		vst4_u8(dst + 4 * x + 32, px);
+	}
+	row_xrgb_c(y + x, uv + x, dst + 4 * x, width - x);
+}
+
+static inline uint16x8_t pack_rgb565_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t p = vshll_n_u8(r, 8);
+
+	p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+	return vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+}
+
+static void row_rgb565_neon(const uint8_t *y, const uint8_t *uv,
+		uint8_t *dst, int width)
+{
+	uint16_t *out = (uint16_t *)dst;
+	uint8x8x2_t c, u, v;
+	uint8x8_t r, g, b;
+	uint8x16_t l;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		l = vld1q_u8(y + x);
+		c = vld2_u8(uv + x);
+		u = vzip_u8(c.val[0], c.val[0]);
+		v = vzip_u8(c.val[1], c.val[1]);
+
+		yuv_to_rgb_neon(vget_low_u8(l), u.val[0], v.val[0], &r, &g, &b);
+		vst1q_u16(out + x, pack_rgb565_neon(r, g, b));
+		yuv_to_rgb_neon(vget_high_u8(l), u.val[1], v.val[1], &r, &g, &b);
+		vst1q_u16(out + x + 8, pack_rgb565_neon(r, g, b));
+	}
+	row_rgb565_c(y + x, uv + x, dst + 2 * x, width - x);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+/* Fastest first, the scalar kernels are the reference */
+static const struct convert_kernels kernels[] = {
+#ifdef HAVE_X86_KERNELS
+	{ "avx2", avx2_supported, split_avx2, row_xrgb_avx2, row_rgb565_avx2 },
+	{ "sse4", sse4_supported, split_sse4, row_xrgb_sse4, row_rgb565_sse4 },
+#endif
+#ifdef HAVE_NEON_KERNELS
+	{ "neon", always_supported, split_neon, row_xrgb_neon, row_rgb565_neon },
+#endif
+	{ "scalar", always_supported, split_c, row_xrgb_c, row_rgb565_c },
+};
+
+#define KERNEL_COUNT (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct convert_kernels *active = &kernels[KERNEL_COUNT - 1];
+
+/*
+ * Select the named kernels, or the fastest the CPU supports if name
+ * is NULL. Returns the name of the kernels in use, NULL if the named
+ * ones are not available.
+ */
+const char *convert_init(const char *name)
+{
+	int i;
+
+	for (i = 0; i < KERNEL_COUNT; i++) {
+		if (name && strcmp(name, kernels[i].name))
+			continue;
+		if (kernels[i].supported()) {
+			active = &kernels[i];
+			return active->name;
+		}
+	}
+	return NULL;
+}
+
+int convert_supported(const struct format *src, const struct format *dst)
+{
+	/* All the YUV formats have 4:2:2 or 4:2:0 chroma */
+	return src->yuv &&
+		(dst->drm_fourcc == DRM_FORMAT_XRGB8888 ||
+		 dst->drm_fourcc == DRM_FORMAT_RGB565);
+}
+
+void image_init(struct image *img, const struct format *f,
+		uint32_t width, uint32_t height, void *data, uint32_t pitch)
+{
+	uint32_t pitches[4], offsets[4];
+	int i;
+
+	format_layout(f, pitch, height, pitches, offsets);
+	img->format = f;
+	img->width = width;
+	img->height = height;
+	for (i = 0; i < f->planes; i++) {
+		img->planes[i] = (uint8_t *)data + offsets[i];
+		img->pitches[i] = pitches[i];
+	}
+}
+
+static void convert_rows_with(const struct convert_kernels *k,
+		const struct image *src, struct image *dst,
+		uint32_t y0, uint32_t y1)
+{
+	const struct format *f = src->format;
+	uint8_t ybuf[CONVERT_MAX_WIDTH], uvbuf[CONVERT_MAX_WIDTH];
+	void (*row)(const uint8_t *, const uint8_t *, uint8_t *, int);
+	uint32_t width = src->width < dst->width ? src->width : dst->width;
+	const uint8_t *yrow, *uvrow;
+	uint32_t y;
+
+	if (width > CONVERT_MAX_WIDTH)
+		width = CONVERT_MAX_WIDTH;
+	row = dst->format->drm_fourcc == DRM_FORMAT_RGB565 ?
+		k->to_rgb565 : k->to_xrgb;
+
+	for (y = y0; y < y1; y++) {
+		if (f->planes == 1) {
+			k->split(src->planes[0] + y * src->pitches[0],
+				ybuf, uvbuf, width,
+				f->drm_fourcc == DRM_FORMAT_UYVY);
+			yrow = ybuf;
+			uvrow = uvbuf;
+		} else {
+			yrow = src->planes[0] + y * src->pitches[0];
+			uvrow = src->planes[1] + y / f->vsub * src->pitches[1];
+		}
+		row(yrow, uvrow, dst->planes[0] + y * dst->pitches[0], width);
+	}
+}
+
+/*
+ * Convert rows y0 to y1 - 1 of src into dst. Only touches those rows,
+ * so disjoint ranges of the same frame may be converted concurrently.
+ */
+void convert_rows(const struct image *src, struct image *dst,
+		uint32_t y0, uint32_t y1)
+{
+	convert_rows_with(active, src, dst, y0, y1);
+}
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Report the throughput of every kernel available on this CPU, for
+ * each conversion, checking the output against the scalar kernels.
+ */
+void convert_bench(uint32_t width, uint32_t height, int frames)
+{
+	const struct format *dst_formats[] = {
+		format_from_drm(DRM_FORMAT_XRGB8888),
+		format_from_drm(DRM_FORMAT_RGB565),
+	};
+	struct image src, dst, ref;
+	uint8_t *src_data, *dst_data, *ref_data;
+	uint32_t src_pitch, dst_pitch;
+	uint64_t start, ns;
+	size_t i, src_size, dst_size;
+	int s, d, k, n;
+
+	if (width > CONVERT_MAX_WIDTH)
+		width = CONVERT_MAX_WIDTH;
+
+	/* Big enough for any format, 4 bytes per pixel */
+	src_size = dst_size = (size_t)width * height * 4;
+	src_data = malloc(src_size);
+	dst_data = malloc(dst_size);
+	ref_data = malloc(dst_size);
+	if (!src_data || !dst_data || !ref_data) {
+		printf("convert: cannot allocate %zu bytes\n", src_size);
+		goto out;
+	}
+	for (i = 0; i < src_size; i++)
+		src_data[i] = rand();
+
+	printf("convert: %ux%u, %d frames\n", width, height, frames);
+	for (s = 0; s < format_count; s++) {
+		for (d = 0; d < 2; d++) {
+			if (!convert_supported(&formats[s], dst_formats[d]))
+				continue;
+
+			src_pitch = width * formats[s].cpp[0];
+			dst_pitch = width * dst_formats[d]->cpp[0];
+			image_init(&src, &formats[s], width, height, src_data, src_pitch);
+			image_init(&dst, dst_formats[d], width, height, dst_data, dst_pitch);
+			image_init(&ref, dst_formats[d], width, height, ref_data, dst_pitch);
+			convert_rows_with(&kernels[KERNEL_COUNT - 1], &src, &ref, 0, height);
+
+			for (k = 0; k < KERNEL_COUNT; k++) {
+				if (!kernels[k].supported())
+					continue;
+
+				memset(dst_data, 0, dst_size);
+				start = bench_ns();
+				for (n = 0; n < frames; n++)
+					convert_rows_with(&kernels[k], &src, &dst, 0, height);
+				ns = bench_ns() - start;
+
+				printf("convert: %-6s %-4s -> %-8s %8.1f MPix/s%s\n",
+					kernels[k].name, formats[s].name,
+					dst_formats[d]->name,
+					ns ? (double)width * height * frames * 1000 / ns : 0,
+					memcmp(dst_data, ref_data, (size_t)dst_pitch * height) ?
+						", MISMATCH" : "");
+			}
+		}
+	}
+
+out:
+	free(src_data);
+	free(dst_data);
+	free(ref_data);
+}
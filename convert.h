@@ -0,0 +1,23 @@
+#include <stdint.h>
+
+#include "format.h"
+
+/* A frame in memory, one pointer and pitch per plane of its format */
+struct image {
+	const struct format *format;
+	uint32_t width, height;
+	uint8_t *planes[FORMAT_MAX_PLANES];
+	uint32_t pitches[FORMAT_MAX_PLANES];
+};
+
+/* Widest frame the conversion handles, the row buffers live on the stack */
+#define CONVERT_MAX_WIDTH 8192
+
+void image_init(struct image *img, const struct format *f,
+		uint32_t width, uint32_t height, void *data, uint32_t pitch);
+
+const char *convert_init(const char *kernel);
+int convert_supported(const struct format *src, const struct format *dst);
+void convert_rows(const struct image *src, struct image *dst,
+		uint32_t y0, uint32_t y1);
+void convert_bench(uint32_t width, uint32_t height, int frames);
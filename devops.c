@@ -0,0 +1,27 @@
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "devops.h"
+
+static int real_v4l2_ioctl(int fd, unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+
+static uint64_t real_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const struct devops devops_real = {
+	.name			= "real",
+	.v4l2_ioctl		= real_v4l2_ioctl,
+	.drm_ioctl		= drmIoctl,
+	.drm_handle_event	= drmHandleEvent,
+	.now_ns			= real_now_ns,
+};
+
+const struct devops *devops = &devops_real;
@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include <xf86drm.h>
+
+/*
+ * What the pipeline does to the devices: V4L2 ioctls, DRM atomic
+ * commits, reading DRM events and the clock. Pointing devops at the
+ * mock backend runs the same code without any device, on simulated
+ * time. The rest of the DRM setup goes through libdrm directly.
+ */
+struct devops {
+	const char *name;
+	int (*v4l2_ioctl)(int fd, unsigned long request, void *arg);
+	int (*drm_ioctl)(int fd, unsigned long request, void *arg);
+	int (*drm_handle_event)(int fd, drmEventContext *ev);
+	/* CLOCK_MONOTONIC, the clock V4L2 and DRM timestamps are in */
+	uint64_t (*now_ns)(void);
+};
+
+extern const struct devops devops_real;
+extern const struct devops devops_mock;
+extern const struct devops *devops;
@@ -0,0 +1,58 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "dmabuf.h"
+#include "hist.h"
+#include "log.h"
+
+/* Returns NULL if the exporter doesn't support mmap() */
+void *dmabuf_mmap(int fd, size_t size)
+{
+	void *data;
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		log_warn("DMABUF: cannot map fd=%d: %m\n", fd);
+		return NULL;
+	}
+	return data;
+}
+
+static uint64_t sync_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int dmabuf_sync(int fd, uint64_t flags, struct hist *sync_ns)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+	uint64_t start = sync_clock_ns();
+	int ret;
+
+	do {
+		ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+
+	if (sync_ns)
+		hist_record(sync_ns, sync_clock_ns() - start);
+	if (ret)
+		log_error("DMABUF: sync fd=%d failed: %m\n", fd);
+	return ret;
+}
+
+int dmabuf_begin(int fd, unsigned int access, struct hist *sync_ns)
+{
+	return dmabuf_sync(fd, DMA_BUF_SYNC_START | access, sync_ns);
+}
+
+int dmabuf_end(int fd, unsigned int access, struct hist *sync_ns)
+{
+	return dmabuf_sync(fd, DMA_BUF_SYNC_END | access, sync_ns);
+}
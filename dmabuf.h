@@ -0,0 +1,15 @@
+#include <stddef.h>
+#include <linux/dma-buf.h>
+
+struct hist;
+
+/*
+ * CPU access to a dmabuf. The mapping may be cached, so every access
+ * has to sit between dmabuf_begin() and dmabuf_end() for the exporter
+ * to flush or invalidate the caches around it. access is
+ * DMA_BUF_SYNC_READ, DMA_BUF_SYNC_WRITE or both. The time spent in the
+ * sync ioctls is recorded into sync_ns, if not NULL.
+ */
+void *dmabuf_mmap(int fd, size_t size);
+int dmabuf_begin(int fd, unsigned int access, struct hist *sync_ns);
+int dmabuf_end(int fd, unsigned int access, struct hist *sync_ns);
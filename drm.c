@@ -9,10 +9,14 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <libdrm/drm.h>
 #include <libdrm/drm_fourcc.h>
 #include "drm.h"
+#include "dmabuf.h"
+#include "devops.h"
+#include "log.h"
 
 #define BPP 32
 
@@ -36,12 +40,134 @@ static void *emmap(int addr, size_t len, int prot, int flag, int fd, off_t offse
 	return fp;
 }
 
-static int get_plane_id(int drm_fd, struct drm_dev_t *dev)
+static int plane_in_use(struct drm_dev_t *dev_head, struct drm_dev_t *dev,
+		uint32_t plane_id)
 {
-	drmModePlaneResPtr plane_resources;
+	struct drm_dev_t *d;
+
+	for (d = dev_head; d; d = d->next)
+		if (d != dev && d->plane_id == plane_id)
+			return 1;
+	return 0;
+}
+
+/*
+ * Names of the property IDs seen so far. Core properties like FB_ID or
+ * CRTC_ID are the same object on every plane or CRTC, so once the
+ * first object is looked up the others mostly need no ioctl.
+ */
+#define PROP_CACHE_SIZE 128
+
+static struct {
+	uint32_t id;
+	char name[DRM_PROP_NAME_LEN];
+} prop_cache[PROP_CACHE_SIZE];
+static int prop_cache_count;
+static unsigned long prop_fetches;
+
+static const char *prop_cache_name(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < prop_cache_count; i++)
+		if (prop_cache[i].id == id)
+			return prop_cache[i].name;
+	return NULL;
+}
+
+/*
+ * Index in props of the property called name, -1 if the object has
+ * none. Property info is only fetched for IDs not seen before, and
+ * only until the name turns up.
+ */
+static int find_property(int fd, drmModeObjectProperties *props,
+		const char *name)
+{
+	drmModePropertyRes *p;
+	const char *known;
+	uint32_t i;
+	int found;
+
+	for (i = 0; i < props->count_props; i++) {
+		known = prop_cache_name(props->props[i]);
+		if (known && strcmp(known, name) == 0)
+			return i;
+	}
+
+	for (i = 0; i < props->count_props; i++) {
+		if (prop_cache_name(props->props[i]))
+			continue;
+		p = drmModeGetProperty(fd, props->props[i]);
+		if (!p)
+			continue;
+		prop_fetches++;
+		if (prop_cache_count < PROP_CACHE_SIZE) {
+			prop_cache[prop_cache_count].id = p->prop_id;
+			memcpy(prop_cache[prop_cache_count].name, p->name,
+					DRM_PROP_NAME_LEN);
+			prop_cache_count++;
+		}
+		found = strcmp(p->name, name) == 0;
+		drmModeFreeProperty(p);
+		if (found)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Linear buffers are all we allocate: check IN_FORMATS for a linear
+ * modifier if the plane has it, else its legacy format list.
+ */
+static int plane_supports_format(int drm_fd, drmModePlanePtr plane,
+		uint32_t in_formats, uint32_t format)
+{
+	drmModePropertyBlobPtr blob;
+	struct drm_format_modifier_blob *header;
+	struct drm_format_modifier *mods;
+	uint32_t *fmts;
 	uint32_t i, j;
-	int ret = -EINVAL;
-	int found_primary = 0;
+	int found = 0;
+
+	if (!in_formats || !(blob = drmModeGetPropertyBlob(drm_fd, in_formats))) {
+		for (i = 0; i < plane->count_formats; i++)
+			if (plane->formats[i] == format)
+				return 1;
+		return 0;
+	}
+
+	header = blob->data;
+	fmts = (uint32_t *)((char *)header + header->formats_offset);
+	mods = (struct drm_format_modifier *)((char *)header + header->modifiers_offset);
+
+	for (i = 0; i < header->count_formats && !found; i++) {
+		if (fmts[i] != format)
+			continue;
+		/* Each modifier has a mask of the 64 formats from offset */
+		for (j = 0; j < header->count_modifiers && !found; j++)
+			found = mods[j].modifier == DRM_FORMAT_MOD_LINEAR &&
+				i >= mods[j].offset && i < mods[j].offset + 64 &&
+				(mods[j].formats & (1ull << (i - mods[j].offset)));
+	}
+
+	drmModeFreePropertyBlob(blob);
+	return found;
+}
+
+/*
+ * Pick a free plane of the CRTC able to scan out format. YUV goes to
+ * an overlay plane when there is one, leaving the primary plane alone,
+ * RGB to the primary plane.
+ */
+static int get_plane_id(int drm_fd, struct drm_dev_t *dev_head,
+		struct drm_dev_t *dev, uint32_t format)
+{
+	const struct format *f = format_from_drm(format);
+	int want_type = f && f->yuv ? DRM_PLANE_TYPE_OVERLAY : DRM_PLANE_TYPE_PRIMARY;
+	drmModePlaneResPtr plane_resources;
+	uint32_t i;
+	int j, ret = -EINVAL;
+	int found_type = 0;
 
 	plane_resources = drmModeGetPlaneResources(drm_fd);
 	if (!plane_resources) {
@@ -49,37 +175,46 @@ static int get_plane_id(int drm_fd, struct drm_dev_t *dev)
 		return -1;
 	}
 
-	for (i = 0; (i < plane_resources->count_planes) && !found_primary; i++) {
+	for (i = 0; (i < plane_resources->count_planes) && !found_type; i++) {
 		uint32_t id = plane_resources->planes[i];
-		drmModePlanePtr plane = drmModeGetPlane(drm_fd, id);
+		uint32_t in_formats = 0;
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+		drmModeObjectPropertiesPtr props;
+		drmModePlanePtr plane;
+
+		/* taken by another device */
+		if (plane_in_use(dev_head, dev, id))
+			continue;
+
+		plane = drmModeGetPlane(drm_fd, id);
 		if (!plane) {
 			printf("drmModeGetPlane(%u) failed: %s\n", id, strerror(errno));
 			continue;
 		}
 
-		printf("plane id: %d for 0x%x\n", id, plane->possible_crtcs);
-
-		if (plane->possible_crtcs & (1 << dev->crtc_index)) {
-			drmModeObjectPropertiesPtr props =
-				drmModeObjectGetProperties(drm_fd, id, DRM_MODE_OBJECT_PLANE);
-
-			/* primary or not, this plane is good enough to use: */
-			ret = id;
-
-			for (j = 0; j < props->count_props; j++) {
-				drmModePropertyPtr p =
-					drmModeGetProperty(drm_fd, props->props[j]);
+		if (!(plane->possible_crtcs & (1 << dev->crtc_index))) {
+			drmModeFreePlane(plane);
+			continue;
+		}
 
-				if ((strcmp(p->name, "type") == 0) &&
-						(props->prop_values[j] == DRM_PLANE_TYPE_PRIMARY)) {
-					/* found our primary plane, lets use that: */
-					found_primary = 1;
-				}
+		props = drmModeObjectGetProperties(drm_fd, id, DRM_MODE_OBJECT_PLANE);
+		if (props) {
+			if ((j = find_property(drm_fd, props, "type")) >= 0)
+				type = props->prop_values[j];
+			if ((j = find_property(drm_fd, props, "IN_FORMATS")) >= 0)
+				in_formats = props->prop_values[j];
+			drmModeFreeObjectProperties(props);
+		}
 
-				drmModeFreeProperty(p);
-			}
+		printf("plane id: %d for 0x%x, type %d\n", id,
+			plane->possible_crtcs, (int)type);
 
-			drmModeFreeObjectProperties(props);
+		if (type != DRM_PLANE_TYPE_CURSOR &&
+		    plane_supports_format(drm_fd, plane, in_formats, format)) {
+			/* not the preferred type, but good enough to use: */
+			if (ret < 0 || type == (uint64_t)want_type)
+				ret = id;
+			found_type = type == (uint64_t)want_type;
 		}
 
 		drmModeFreePlane(plane);
@@ -90,22 +225,22 @@ static int get_plane_id(int drm_fd, struct drm_dev_t *dev)
 	return ret;
 }
 
-static int add_plane_property(struct drm_dev_t *dev,
+static int get_property_id(int fd, drmModeObjectProperties *props,
+		const char *name)
+{
+	int i = find_property(fd, props, name);
+
+	return i < 0 ? -1 : (int)props->props[i];
+}
+
+static int add_plane_property(int fd, struct drm_dev_t *dev,
 		drmModeAtomicReq *req, uint32_t obj_id,
 		const char *name, uint64_t value)
 {
         struct plane *obj = dev->plane;
-        unsigned int i;
-        int prop_id = -1;
-
-        for (i = 0 ; i < obj->props->count_props ; i++) {
-                if (strcmp(obj->props_info[i]->name, name) == 0) {
-                        prop_id = obj->props_info[i]->prop_id;
-                        break;
-                }
-        }
-
+        int prop_id;
 
+        prop_id = get_property_id(fd, obj->props, name);
         if (prop_id < 0) {
                 printf("no plane property: %s\n", name);
                 return -EINVAL;
@@ -114,36 +249,395 @@ static int add_plane_property(struct drm_dev_t *dev,
         return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
 }
 
-void drm_render_atomic(int drm_fd, int fb_id, struct drm_dev_t *dev)
+static const char * const plane_prop_names[PLANE_PROP_COUNT] = {
+	[PLANE_FB_ID]		= "FB_ID",
+	[PLANE_CRTC_ID]		= "CRTC_ID",
+	[PLANE_SRC_X]		= "SRC_X",
+	[PLANE_SRC_Y]		= "SRC_Y",
+	[PLANE_SRC_W]		= "SRC_W",
+	[PLANE_SRC_H]		= "SRC_H",
+	[PLANE_CRTC_X]		= "CRTC_X",
+	[PLANE_CRTC_Y]		= "CRTC_Y",
+	[PLANE_CRTC_W]		= "CRTC_W",
+	[PLANE_CRTC_H]		= "CRTC_H",
+	[PLANE_IN_FENCE_FD]	= "IN_FENCE_FD",
+};
+
+static const char * const crtc_prop_names[CRTC_PROP_COUNT] = {
+	[CRTC_ACTIVE]		= "ACTIVE",
+	[CRTC_MODE_ID]		= "MODE_ID",
+	[CRTC_OUT_FENCE_PTR]	= "OUT_FENCE_PTR",
+};
+
+static const char * const connector_prop_names[CONNECTOR_PROP_COUNT] = {
+	[CONNECTOR_CRTC_ID]	= "CRTC_ID",
+};
+
+static void resolve_property_ids(int fd, drmModeObjectProperties *props,
+		const char * const *names, uint32_t *ids, int count)
 {
-        drmModeAtomicReq *req;
-        uint32_t plane_id = dev->plane_id;
-        int ret;
+	int i, id;
 
-        req = drmModeAtomicAlloc();
+	for (i = 0; i < count; i++) {
+		id = get_property_id(fd, props, names[i]);
+		ids[i] = id < 0 ? 0 : id;
+	}
+}
 
-        add_plane_property(dev, req, plane_id, "FB_ID", fb_id);
-        add_plane_property(dev, req, plane_id, "CRTC_ID", dev->crtc_id);
-        add_plane_property(dev, req, plane_id, "SRC_X", 0);
-        add_plane_property(dev, req, plane_id, "SRC_Y", 0);
-        add_plane_property(dev, req, plane_id, "SRC_W", dev->width << 16);
-        add_plane_property(dev, req, plane_id, "SRC_H", dev->height << 16);
-        add_plane_property(dev, req, plane_id, "CRTC_X", 0);
-        add_plane_property(dev, req, plane_id, "CRTC_Y", 0);
-        add_plane_property(dev, req, plane_id, "CRTC_W", dev->width);
-        add_plane_property(dev, req, plane_id, "CRTC_H", dev->height);
+/*
+ * The largest w x h rectangle with the same aspect ratio as the area,
+ * centered in it: letterboxed or pillarboxed. Frames smaller than the
+ * area keep their size unless upscale is set.
+ */
+void drm_rect_fit(uint32_t w, uint32_t h, uint32_t area_w, uint32_t area_h,
+		int upscale, struct drm_rect *r)
+{
+	if (upscale || w > area_w || h > area_h) {
+		if ((uint64_t)w * area_h > (uint64_t)h * area_w) {
+			h = (uint64_t)h * area_w / w;
+			w = area_w;
+		} else {
+			w = (uint64_t)w * area_h / h;
+			h = area_h;
+		}
+	}
+	r->x = (area_w - w) / 2;
+	r->y = (area_h - h) / 2;
+	r->w = w;
+	r->h = h;
+}
 
-        ret = drmModeAtomicCommit(drm_fd, req, DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK, dev);
-	if (ret)
-		printf("DRM: Failed drmModeAtomicCommit %d\n", ret);	
+/*
+ * Show the src crop of the framebuffer in the dst rectangle of the
+ * display, scaled by the plane. Nothing is committed, the change goes
+ * with the next flip.
+ */
+void drm_set_viewport(struct drm_dev_t *dev, const struct drm_rect *src,
+		const struct drm_rect *dst)
+{
+	uint64_t *v = dev->commit.values;
+
+	v[PLANE_SRC_X] = (uint64_t)src->x << 16;
+	v[PLANE_SRC_Y] = (uint64_t)src->y << 16;
+	v[PLANE_SRC_W] = (uint64_t)src->w << 16;
+	v[PLANE_SRC_H] = (uint64_t)src->h << 16;
+	v[PLANE_CRTC_X] = dst->x;
+	v[PLANE_CRTC_Y] = dst->y;
+	v[PLANE_CRTC_W] = dst->w;
+	v[PLANE_CRTC_H] = dst->h;
+	dev->viewport_dirty = VIEWPORT_PENDING;
+}
 
-	drmModeAtomicFree(req);
+/*
+ * Digital zoom by zoom percent around (cx, cy) of the framebuffer,
+ * keeping the frame where drm_rect_fit() puts it on the display.
+ */
+void drm_set_zoom(struct drm_dev_t *dev, unsigned int zoom,
+		uint32_t cx, uint32_t cy)
+{
+	struct drm_rect src, dst;
+
+	if (zoom < 100)
+		zoom = 100;
+	src.w = (uint64_t)dev->fb_width * 100 / zoom;
+	src.h = (uint64_t)dev->fb_height * 100 / zoom;
+	src.x = cx < src.w / 2 ? 0 : cx - src.w / 2;
+	src.y = cy < src.h / 2 ? 0 : cy - src.h / 2;
+	if (src.x + src.w > dev->fb_width)
+		src.x = dev->fb_width - src.w;
+	if (src.y + src.h > dev->fb_height)
+		src.y = dev->fb_height - src.h;
+
+	drm_rect_fit(dev->fb_width, dev->fb_height, dev->width, dev->height,
+			0, &dst);
+	drm_set_viewport(dev, &src, &dst);
+}
+
+/*
+ * With fit, show the framebuffer centered on the display, scaled down
+ * to fit if it is larger. Otherwise show it 1:1 from the top-left
+ * corner, cropped to the display.
+ */
+static void drm_commit_set_rect(struct drm_dev_t *dev, int fit)
+{
+	struct drm_rect src = { 0, 0, dev->fb_width, dev->fb_height };
+	struct drm_rect dst = { 0, 0, dev->width, dev->height };
+
+	if (fit) {
+		drm_rect_fit(src.w, src.h, dst.w, dst.h, 0, &dst);
+	} else {
+		src.w = dst.w = src.w < dst.w ? src.w : dst.w;
+		src.h = dst.h = src.h < dst.h ? src.h : dst.h;
+	}
+	drm_set_viewport(dev, &src, &dst);
+}
+
+/* Keep the viewport the kernel took, or go back to the previous one */
+static void drm_viewport_done(struct drm_dev_t *dev, int ret)
+{
+	uint64_t *rect = &dev->commit.values[PLANE_SRC_X];
+
+	/* Changed again since it was sent, the new one goes next */
+	if (dev->viewport_dirty != VIEWPORT_SENT)
+		return;
+	/* Other errors say nothing about the viewport, try it again */
+	if (ret && ret != -EINVAL && ret != -ERANGE) {
+		dev->viewport_dirty = VIEWPORT_PENDING;
+		return;
+	}
+	dev->viewport_dirty = VIEWPORT_SHOWN;
+
+	if (!ret) {
+		memcpy(dev->viewport_shown, rect, sizeof(dev->viewport_shown));
+		return;
+	}
+	log_warn("DRM: plane %d rejected the viewport, keeping the previous one\n",
+		dev->plane_id);
+	memcpy(rect, dev->viewport_shown, sizeof(dev->viewport_shown));
+}
+
+/* Lay the request out from the property IDs */
+static int drm_layout_commit(struct drm_dev_t *dev)
+{
+	struct drm_commit_t *c = &dev->commit;
+	int i;
+
+	for (i = 0; i < PLANE_BASE_PROP_COUNT; i++) {
+		if (!dev->plane->prop_ids[i]) {
+			printf("no plane property: %s\n", plane_prop_names[i]);
+			return -EINVAL;
+		}
+		c->props[i] = dev->plane->prop_ids[i];
+	}
+
+	c->values[PLANE_FB_ID] = 0;
+	c->values[PLANE_CRTC_ID] = dev->crtc_id;
+	drm_commit_set_rect(dev, 0);
+
+	c->objs[0] = dev->plane_id;
+	c->objs[1] = dev->crtc_id;
+	c->atomic.objs_ptr = (uintptr_t)c->objs;
+	c->atomic.count_props_ptr = (uintptr_t)c->count_props;
+	c->atomic.props_ptr = (uintptr_t)c->props;
+	c->atomic.prop_values_ptr = (uintptr_t)c->values;
+	c->atomic.user_data = (uintptr_t)dev;
+
+	return 0;
 }
 
-void drm_render_legacy(int drm_fd, int fb_id, struct drm_dev_t *dev)
+static int drm_prepare_commit(int fd, struct drm_dev_t *dev)
 {
-	drmModePageFlip(drm_fd, dev->crtc_id, fb_id,
-		DRM_MODE_PAGE_FLIP_EVENT, dev);
+	resolve_property_ids(fd, dev->plane->props, plane_prop_names,
+			dev->plane->prop_ids, PLANE_PROP_COUNT);
+	resolve_property_ids(fd, dev->crtc->props, crtc_prop_names,
+			dev->crtc->prop_ids, CRTC_PROP_COUNT);
+	resolve_property_ids(fd, dev->connector->props, connector_prop_names,
+			dev->connector->prop_ids, CONNECTOR_PROP_COUNT);
+
+	return drm_layout_commit(dev);
+}
+
+int drm_has_fences(struct drm_dev_t *dev)
+{
+	return dev->plane->prop_ids[PLANE_IN_FENCE_FD] &&
+		dev->crtc->prop_ids[CRTC_OUT_FENCE_PTR];
+}
+
+/* Patch the prepared request of dev for a flip to fb_id */
+static void drm_commit_fill(int fb_id, int in_fence_fd, int *out_fence_fd,
+		struct drm_dev_t *dev)
+{
+	struct drm_commit_t *c = &dev->commit;
+	int n = PLANE_BASE_PROP_COUNT;
+
+	c->values[PLANE_FB_ID] = fb_id;
+	if (dev->viewport_dirty)
+		dev->viewport_dirty = VIEWPORT_SENT;
+
+	/* Optional properties are appended after the base ones */
+	if (in_fence_fd >= 0) {
+		c->props[n] = dev->plane->prop_ids[PLANE_IN_FENCE_FD];
+		c->values[n++] = in_fence_fd;
+	}
+	c->count_props[0] = n;
+	c->atomic.count_objs = 1;
+
+	if (out_fence_fd) {
+		*out_fence_fd = -1;
+		c->props[n] = dev->crtc->prop_ids[CRTC_OUT_FENCE_PTR];
+		c->values[n++] = (uintptr_t)out_fence_fd;
+		c->count_props[1] = 1;
+		c->atomic.count_objs = 2;
+	}
+}
+
+static int drm_commit(int drm_fd, int fb_id, int in_fence_fd,
+		int *out_fence_fd, struct drm_dev_t *dev, uint32_t flags)
+{
+	struct drm_commit_t *c = &dev->commit;
+	int viewport_dirty = dev->viewport_dirty;
+	int ret = 0;
+
+	drm_commit_fill(fb_id, in_fence_fd, out_fence_fd, dev);
+	c->atomic.flags = flags;
+	if (devops->drm_ioctl(drm_fd, DRM_IOCTL_MODE_ATOMIC, &c->atomic))
+		ret = -errno;
+	/* A test applies nothing, the viewport still has to be sent */
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		dev->viewport_dirty = viewport_dirty;
+	else
+		drm_viewport_done(dev, ret);
+	return ret;
+}
+
+/*
+ * Flip to fb_id as soon as possible instead of waiting for vblank, at
+ * the cost of tearing. If in_fence_fd is valid, the kernel waits for it
+ * before scanning out the buffer. If out_fence_fd is not NULL, it
+ * receives a fence signaled once the flip is done, i.e. when the buffer
+ * previously on screen is released.
+ */
+int drm_render_async(int drm_fd, int fb_id, int in_fence_fd,
+		int *out_fence_fd, struct drm_dev_t *dev)
+{
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	/* Async flips may only change FB_ID, a new viewport waits for vblank */
+	if (!dev->viewport_dirty)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+	return drm_commit(drm_fd, fb_id, in_fence_fd, out_fence_fd, dev, flags);
+}
+
+/*
+ * Add a flip of dev to the batch, same arguments as drm_render_async().
+ * Nothing reaches the kernel before drm_batch_commit(), so in_fence_fd
+ * must stay open until then.
+ */
+int drm_batch_add(struct drm_batch_t *batch, int fb_id, int in_fence_fd,
+		int *out_fence_fd, struct drm_dev_t *dev)
+{
+	struct drm_commit_t *c = &dev->commit;
+	int i, n;
+
+	if (batch->count == DRM_BATCH_MAX)
+		return -ENOSPC;
+	for (i = 0; i < batch->count; i++)
+		if (batch->devs[i] == dev)
+			return -EBUSY;
+
+	drm_commit_fill(fb_id, in_fence_fd, out_fence_fd, dev);
+
+	/* Append the plane, and the CRTC if it has a property to set */
+	n = c->count_props[0];
+	if (c->atomic.count_objs == 2)
+		n += c->count_props[1];
+	memcpy(&batch->objs[batch->count_objs], c->objs,
+			c->atomic.count_objs * sizeof(c->objs[0]));
+	memcpy(&batch->count_props[batch->count_objs], c->count_props,
+			c->atomic.count_objs * sizeof(c->count_props[0]));
+	memcpy(&batch->props[batch->count_values], c->props,
+			n * sizeof(c->props[0]));
+	memcpy(&batch->values[batch->count_values], c->values,
+			n * sizeof(c->values[0]));
+	batch->count_objs += c->atomic.count_objs;
+	batch->count_values += n;
+
+	batch->devs[batch->count++] = dev;
+	return 0;
+}
+
+/*
+ * Send every flip of the batch as a single atomic commit. Each CRTC
+ * gets its own page-flip event, tell them apart by their crtc_id.
+ * The batch is left as is, so the caller can look at batch->devs,
+ * then empties it with drm_batch_reset().
+ */
+int drm_batch_commit(int drm_fd, struct drm_batch_t *batch)
+{
+	struct drm_mode_atomic *atomic = &batch->atomic;
+	int i, ret = 0;
+
+	if (!batch->count)
+		return 0;
+
+	memset(atomic, 0, sizeof(*atomic));
+	atomic->flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	atomic->count_objs = batch->count_objs;
+	atomic->objs_ptr = (uintptr_t)batch->objs;
+	atomic->count_props_ptr = (uintptr_t)batch->count_props;
+	atomic->props_ptr = (uintptr_t)batch->props;
+	atomic->prop_values_ptr = (uintptr_t)batch->values;
+
+	batch->commits++;
+	batch->updates += batch->count;
+	if (devops->drm_ioctl(drm_fd, DRM_IOCTL_MODE_ATOMIC, atomic))
+		ret = -errno;
+	for (i = 0; i < batch->count; i++)
+		drm_viewport_done(batch->devs[i], ret);
+	if (ret) {
+		batch->failures++;
+		log_error("DRM: Failed batched atomic commit of %d planes: %s\n",
+			batch->count, strerror(-ret));
+	}
+	return ret;
+}
+
+void drm_batch_reset(struct drm_batch_t *batch)
+{
+	batch->count = 0;
+	batch->count_objs = 0;
+	batch->count_values = 0;
+}
+
+static uint64_t cpu_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Compare the per-commit CPU cost of building the request through
+ * libdrm, looking up properties by name, against the prepared commit.
+ * TEST_ONLY commits are used so nothing reaches the screen.
+ */
+void drm_bench_commit(int drm_fd, int fb_id, struct drm_dev_t *dev, int count)
+{
+	uint32_t plane_id = dev->plane_id;
+	uint64_t *v = dev->commit.values;
+	uint64_t start, libdrm_ns, prepared_ns;
+	int i;
+
+	start = cpu_time_ns();
+	for (i = 0; i < count; i++) {
+		drmModeAtomicReq *req = drmModeAtomicAlloc();
+
+		add_plane_property(drm_fd, dev, req, plane_id, "FB_ID", fb_id);
+		add_plane_property(drm_fd, dev, req, plane_id, "CRTC_ID", dev->crtc_id);
+		add_plane_property(drm_fd, dev, req, plane_id, "SRC_X", v[PLANE_SRC_X]);
+		add_plane_property(drm_fd, dev, req, plane_id, "SRC_Y", v[PLANE_SRC_Y]);
+		add_plane_property(drm_fd, dev, req, plane_id, "SRC_W", v[PLANE_SRC_W]);
+		add_plane_property(drm_fd, dev, req, plane_id, "SRC_H", v[PLANE_SRC_H]);
+		add_plane_property(drm_fd, dev, req, plane_id, "CRTC_X", v[PLANE_CRTC_X]);
+		add_plane_property(drm_fd, dev, req, plane_id, "CRTC_Y", v[PLANE_CRTC_Y]);
+		add_plane_property(drm_fd, dev, req, plane_id, "CRTC_W", v[PLANE_CRTC_W]);
+		add_plane_property(drm_fd, dev, req, plane_id, "CRTC_H", v[PLANE_CRTC_H]);
+		drmModeAtomicCommit(drm_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, dev);
+		drmModeAtomicFree(req);
+	}
+	libdrm_ns = cpu_time_ns() - start;
+
+	start = cpu_time_ns();
+	for (i = 0; i < count; i++)
+		drm_commit(drm_fd, fb_id, -1, NULL, dev, DRM_MODE_ATOMIC_TEST_ONLY);
+	prepared_ns = cpu_time_ns() - start;
+
+	printf("DRM: %d test-only commits\n", count);
+	printf("DRM: libdrm request:   %llu ns/commit\n",
+		(unsigned long long)(libdrm_ns / count));
+	printf("DRM: prepared request: %llu ns/commit\n",
+		(unsigned long long)(prepared_ns / count));
 }
 
 int drm_open(const char *path, int need_dumb, int need_prime)
@@ -176,14 +670,260 @@ int drm_open(const char *path, int need_dumb, int need_prime)
 	return fd;
 }
 
-struct drm_dev_t *drm_init(int fd)
+static int crtc_in_use(struct drm_dev_t *dev_head, uint32_t crtc_id)
+{
+	struct drm_dev_t *dev;
+
+	for (dev = dev_head; dev; dev = dev->next)
+		if (dev->crtc_id == crtc_id)
+			return 1;
+	return 0;
+}
+
+/*
+ * Use the CRTC already driving the connector, unless another device
+ * took it, else the first free CRTC one of its encoders can drive.
+ */
+static int find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
+		struct drm_dev_t *dev_head, struct drm_dev_t *dev)
+{
+	drmModeEncoder *enc;
+	int i, j;
+
+	if (conn->encoder_id && (enc = drmModeGetEncoder(fd, conn->encoder_id))) {
+		if (enc->crtc_id && !crtc_in_use(dev_head, enc->crtc_id)) {
+			dev->enc_id = enc->encoder_id;
+			dev->crtc_id = enc->crtc_id;
+		}
+		drmModeFreeEncoder(enc);
+	}
+
+	for (i = 0; i < conn->count_encoders && !dev->crtc_id; i++) {
+		if ((enc = drmModeGetEncoder(fd, conn->encoders[i])) == NULL)
+			continue;
+		for (j = 0; j < res->count_crtcs; j++) {
+			if ((enc->possible_crtcs & (1 << j)) &&
+			    !crtc_in_use(dev_head, res->crtcs[j])) {
+				dev->enc_id = enc->encoder_id;
+				dev->crtc_id = res->crtcs[j];
+				break;
+			}
+		}
+		drmModeFreeEncoder(enc);
+	}
+
+	for (i = 0; i < res->count_crtcs; i++) {
+		if (res->crtcs[i] == dev->crtc_id) {
+			dev->crtc_index = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+#define get_resource(type, Type, id) do { 					\
+		dev->type->type = drmModeGet##Type(fd, id);			\
+		if (!dev->type->type) {						\
+			printf("could not get %s %i: %s\n",			\
+					#type, id, strerror(errno));		\
+			return -1;						\
+		}								\
+	} while (0)
+
+#define get_properties(type, TYPE, id) do {					\
+		dev->type->props = drmModeObjectGetProperties(fd,		\
+				id, DRM_MODE_OBJECT_##TYPE);			\
+		if (!dev->type->props) {						\
+			printf("could not get %s %u properties: %s\n", 		\
+					#type, id, strerror(errno));		\
+			return -1;						\
+		}								\
+	} while (0)
+
+static int drm_init_plane(int fd, struct drm_dev_t *dev)
+{
+	int i;
+
+	get_resource(plane, Plane, dev->plane_id);
+	get_properties(plane, PLANE, dev->plane_id);
+
+	dev->plane->type = DRM_PLANE_TYPE_OVERLAY;
+	if ((i = find_property(fd, dev->plane->props, "type")) >= 0)
+		dev->plane->type = dev->plane->props->prop_values[i];
+	return 0;
+}
+
+static void drm_free_plane(struct plane *plane)
+{
+	drmModeFreeObjectProperties(plane->props);
+	drmModeFreePlane(plane->plane);
+	memset(plane, 0, sizeof(*plane));
+}
+
+/* Everything drm_init() got for dev, and dev itself */
+static void drm_free_dev(struct drm_dev_t *dev)
+{
+	if (dev->plane)
+		drm_free_plane(dev->plane);
+	if (dev->crtc) {
+		drmModeFreeObjectProperties(dev->crtc->props);
+		drmModeFreeCrtc(dev->crtc->crtc);
+	}
+	if (dev->connector) {
+		drmModeFreeObjectProperties(dev->connector->props);
+		drmModeFreeConnector(dev->connector->connector);
+	}
+	free(dev->plane);
+	free(dev->crtc);
+	free(dev->connector);
+	drmModeFreeCrtc(dev->saved_crtc);
+	free(dev);
+}
+
+/* Pick the plane and grab the plane/crtc/connector property IDs */
+static int drm_init_dev(int fd, struct drm_dev_t *dev_head, struct drm_dev_t *dev)
+{
+	int ret;
+
+	ret = get_plane_id(fd, dev_head, dev, dev->format->drm_fourcc);
+	if (ret < 0) {
+		printf("DRM: could not find a suitable plane for CRTC %d\n", dev->crtc_id);
+		return -1;
+	} else {
+		dev->plane_id = ret;
+	}
+
+	printf("DRM: connector id:%d\n", dev->conn_id);
+	printf("DRM: plane id: %d encoder id:%d crtc id:%d\n", dev->plane_id, dev->enc_id, dev->crtc_id);
+	printf("DRM: width:%d height:%d\n", dev->width, dev->height);
+
+	dev->plane = calloc(1, sizeof(*dev->plane));
+	dev->crtc = calloc(1, sizeof(*dev->crtc));
+	dev->connector = calloc(1, sizeof(*dev->connector));
+
+	if (drm_init_plane(fd, dev))
+		return -1;
+	get_resource(crtc, Crtc, dev->crtc_id);
+	get_resource(connector, Connector, dev->conn_id);
+
+	get_properties(crtc, CRTC, dev->crtc_id);
+	get_properties(connector, CONNECTOR, dev->conn_id);
+
+	return drm_prepare_commit(fd, dev);
+}
+
+/* Whether the plane dev uses now can scan out drm_fourcc */
+static int drm_plane_has_format(int fd, struct drm_dev_t *dev,
+		uint32_t drm_fourcc)
+{
+	uint32_t in_formats = 0;
+	int i;
+
+	if ((i = find_property(fd, dev->plane->props, "IN_FORMATS")) >= 0)
+		in_formats = dev->plane->props->prop_values[i];
+	return plane_supports_format(fd, dev->plane->plane, in_formats,
+			drm_fourcc);
+}
+
+/*
+ * Pick the first format in formats[] that the capture device can
+ * produce, as listed in v4l2_fourccs, and a plane of dev can scan
+ * out, moving dev to that plane. Without dev_head, only the plane dev
+ * uses is considered, so the format can change while it shows frames.
+ * Returns NULL if there's none.
+ */
+const struct format *drm_select_format(int fd, struct drm_dev_t *dev_head,
+		struct drm_dev_t *dev, const uint32_t *v4l2_fourccs, int count)
+{
+	const struct format *f;
+	int i, j, plane_id;
+
+	for (i = 0; i < format_count; i++) {
+		f = &formats[i];
+		for (j = 0; j < count; j++)
+			if (v4l2_fourccs[j] == f->v4l2_fourcc)
+				break;
+		if (j == count)
+			continue;
+
+		if (!dev_head) {
+			if (!drm_plane_has_format(fd, dev, f->drm_fourcc))
+				continue;
+			dev->format = f;
+			return f;
+		}
+
+		plane_id = get_plane_id(fd, dev_head, dev, f->drm_fourcc);
+		if (plane_id < 0)
+			continue;
+
+		if ((uint32_t)plane_id != dev->plane_id) {
+			drm_free_plane(dev->plane);
+			dev->plane_id = plane_id;
+			if (drm_init_plane(fd, dev) || drm_prepare_commit(fd, dev))
+				return NULL;
+		}
+
+		printf("DRM: scanning out %s on plane %d\n", f->name, dev->plane_id);
+		dev->format = f;
+		return f;
+	}
+	return NULL;
+}
+
+/*
+ * Keep the mode the CRTC already drives the connector with, e.g. the
+ * one the boot splash or the previous client left, so showing the
+ * frames needs no modeset and the display doesn't blank.
+ */
+static void drm_adopt_mode(int fd, drmModeConnector *conn, struct drm_dev_t *dev)
+{
+	drmModeEncoder *enc;
+	drmModeCrtc *crtc;
+	uint32_t crtc_id = 0;
+
+	if (conn->encoder_id && (enc = drmModeGetEncoder(fd, conn->encoder_id))) {
+		crtc_id = enc->crtc_id;
+		drmModeFreeEncoder(enc);
+	}
+	if (!crtc_id || crtc_id != dev->crtc_id)
+		return;
+
+	crtc = drmModeGetCrtc(fd, crtc_id);
+	if (!crtc)
+		return;
+	if (!crtc->mode_valid) {
+		drmModeFreeCrtc(crtc);
+		return;
+	}
+
+	memcpy(&dev->mode, &crtc->mode, sizeof(drmModeModeInfo));
+	dev->width = dev->fb_width = crtc->mode.hdisplay;
+	dev->height = dev->fb_height = crtc->mode.vdisplay;
+	dev->saved_crtc = crtc;
+	dev->adopted = 1;
+	printf("DRM: connector %d: adopting the active mode %dx%d@%d\n",
+		dev->conn_id, dev->width, dev->height, crtc->mode.vrefresh);
+}
+
+/*
+ * Returns a list with a drm_dev_t for each connected connector, in
+ * connector order, each with its own CRTC and plane. With adopt, a
+ * CRTC already lit keeps its mode instead of the preferred one.
+ */
+struct drm_dev_t *drm_init(int fd, int adopt)
 {
 	int i, m, ret;
-	struct drm_dev_t *dev = NULL, *dev_head = NULL;
+	struct drm_dev_t *dev = NULL, *dev_head = NULL, **dev_tail = &dev_head;
 	drmModeRes *res;
 	drmModeConnector *conn;
-	drmModeEncoder *enc;
-	drmModeModeInfo *mode = NULL, *preferred = NULL;
+	drmModeModeInfo *mode = NULL, *preferred;
+
+	ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret) {
+		printf("DRM: no atomic modesetting support: %s\n", strerror(errno));
+		return NULL;
+	}
 
 	if ((res = drmModeGetResources(fd)) == NULL)
 		fatal("drmModeGetResources() failed");
@@ -197,6 +937,7 @@ struct drm_dev_t *drm_init(int fd)
 			memset(dev, 0, sizeof(struct drm_dev_t));
 
 			/* find preferred mode */
+			preferred = NULL;
 			for (m = 0; m < conn->count_modes; m++) {
 				mode = &conn->modes[m];
 				if (mode->type & DRM_MODE_TYPE_PREFERRED)
@@ -208,102 +949,43 @@ struct drm_dev_t *drm_init(int fd)
 				preferred = &conn->modes[0];
 
 			dev->conn_id = conn->connector_id;
-			dev->enc_id = conn->encoder_id;
 			dev->next = NULL;
 
 			memcpy(&dev->mode, preferred, sizeof(drmModeModeInfo));
 			dev->width = preferred->hdisplay;
 			dev->height = preferred->vdisplay;
 
-			/* FIXME: use default encoder/crtc pair */
-			if ((enc = drmModeGetEncoder(fd, dev->enc_id)) == NULL)
-				fatal("drmModeGetEncoder() faild");
-			dev->crtc_id = enc->crtc_id;
-			drmModeFreeEncoder(enc);
-
+			/* Until drm_select_format() and the capture size say otherwise */
+			dev->format = format_from_drm(DRM_FORMAT_XRGB8888);
+			dev->fb_width = dev->width;
+			dev->fb_height = dev->height;
+			dev->fb_pitch = 0;
 			dev->saved_crtc = NULL;
 
-			/* create dev list */
-			dev->next = dev_head;
-			dev_head = dev;
+			ret = find_crtc(fd, res, conn, dev_head, dev);
+			if (!ret && adopt)
+				drm_adopt_mode(fd, conn, dev);
+
+			if (ret || drm_init_dev(fd, dev_head, dev)) {
+				printf("DRM: skipping connector %d\n", dev->conn_id);
+				drm_free_dev(dev);
+			} else {
+				/* append to dev list */
+				*dev_tail = dev;
+				dev_tail = &dev->next;
+			}
 		}
 		drmModeFreeConnector(conn);
 	}
 
-        for (i = 0; i < res->count_crtcs; i++) {
-		if (res->crtcs[i] == dev->crtc_id) {
-			dev->crtc_index = i;
-			break;
-		}
-	}
-
 	drmModeFreeResources(res);
-
-	ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
-	if (ret) {
-		printf("DRM: no atomic modesetting support: %s\n", strerror(errno));
-		return NULL;
-	}
-
-	ret = get_plane_id(fd, dev);
-	if (ret < 0) {
-		printf("DRM: could not find a suitable plane for CRTC %d\n", dev->crtc_id);
-		return NULL;
-	} else {
-		dev->plane_id = ret;
-	}
-
-	printf("DRM: connector id:%d\n", dev->conn_id);
-	printf("DRM: plane id: %d encoder id:%d crtc id:%d\n", dev->plane_id, dev->enc_id, dev->crtc_id);
-	printf("DRM: width:%d height:%d\n", dev->width, dev->height);
-
-	/* We only do single plane to single crtc to single connector, no
-	 * fancy multi-monitor or multi-plane stuff.  So just grab the
-	 * plane/crtc/connector property info for one of each:
-	 */
-	dev->plane = calloc(1, sizeof(*dev->plane));
-	dev->crtc = calloc(1, sizeof(*dev->crtc));
-	dev->connector = calloc(1, sizeof(*dev->connector));
-
-#define get_resource(type, Type, id) do { 					\
-		dev->type->type = drmModeGet##Type(fd, id);			\
-		if (!dev->type->type) {						\
-			printf("could not get %s %i: %s\n",			\
-					#type, id, strerror(errno));		\
-			return NULL;						\
-		}								\
-	} while (0)
-
-	get_resource(plane, Plane, dev->plane_id);
-	get_resource(crtc, Crtc, dev->crtc_id);
-	get_resource(connector, Connector, dev->conn_id);
-
-#define get_properties(type, TYPE, id) do {					\
-		uint32_t i;							\
-		dev->type->props = drmModeObjectGetProperties(fd,		\
-				id, DRM_MODE_OBJECT_##TYPE);			\
-		if (!dev->type->props) {						\
-			printf("could not get %s %u properties: %s\n", 		\
-					#type, id, strerror(errno));		\
-			return NULL;						\
-		}								\
-		dev->type->props_info = calloc(dev->type->props->count_props,	\
-				sizeof(dev->type->props_info));			\
-		for (i = 0; i < dev->type->props->count_props; i++) {		\
-			dev->type->props_info[i] = drmModeGetProperty(fd,	\
-					dev->type->props->props[i]);		\
-		}								\
-	} while (0)
-
-	get_properties(plane, PLANE, dev->plane_id);
-	get_properties(crtc, CRTC, dev->crtc_id);
-	get_properties(connector, CONNECTOR, dev->conn_id);
+	printf("DRM: %lu properties fetched\n", prop_fetches);
 
 	return dev_head;
 }
 
 static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
-		int width, int height,
+		int width, int height, int bpp,
 		struct drm_buffer_t *buffer, int map, int export)
 {
 	struct drm_mode_create_dumb create_req;
@@ -314,7 +996,7 @@ static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
 	memset(&create_req, 0, sizeof(struct drm_mode_create_dumb));
 	create_req.width = width;
 	create_req.height = height;
-	create_req.bpp = BPP;
+	create_req.bpp = bpp;
 
 	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_req) < 0)
 		fatal("drmIoctl DRM_IOCTL_MODE_CREATE_DUMB failed");
@@ -334,6 +1016,17 @@ static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
 		printf("DRM buffer exported as fd=%d\n", buffer->dmabuf_fd);
 	}
 
+	/* Through the dmabuf the mapping can be cached, the CPU has to
+	 * bracket its accesses with dmabuf_begin() and dmabuf_end().
+	 */
+	if (map && export) {
+		buffer->buf = dmabuf_mmap(buffer->dmabuf_fd, buffer->size);
+		if (buffer->buf) {
+			printf("DRM buffer mapped through dmabuf as %p\n", buffer->buf);
+			return;
+		}
+	}
+
 	if (map) {
 		memset(&map_req, 0, sizeof(struct drm_mode_map_dumb));
 		map_req.handle = buffer->bo_handle;
@@ -347,74 +1040,346 @@ static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
 	}
 }
 
-void drm_setup_dummy(int fd, struct drm_dev_t *dev, int map, int export)
+static void drm_alloc_bufs(struct drm_dev_t *dev, int count)
+{
+	dev->bufs = calloc(count, sizeof(*dev->bufs));
+	if (!dev->bufs)
+		fatal("cannot allocate buffers");
+	dev->buf_count = count;
+}
+
+/*
+ * Dumb buffers that are not framebuffers, e.g. for capturing frames
+ * the CPU converts, sized for width x height in format f.
+ */
+struct drm_buffer_t *drm_alloc_dumb(int fd, int count, const struct format *f,
+		uint32_t width, uint32_t height, int map, int export)
 {
+	struct drm_buffer_t *bufs;
 	int i;
 
-	for (i = 0; i < BUFCOUNT; i++)
-		drm_setup_buffer(fd, dev, dev->width, dev->height,
-				 &dev->bufs[i], map, export);
+	bufs = calloc(count, sizeof(*bufs));
+	if (!bufs)
+		fatal("cannot allocate buffers");
+	for (i = 0; i < count; i++)
+		drm_setup_buffer(fd, NULL, width, format_lines(f, height),
+				 f->cpp[0] * 8, &bufs[i], map, export);
+	return bufs;
+}
 
-	/* Assume all buffers have the same pitch */
-	dev->pitch = dev->bufs[0].pitch;
-	printf("DRM: buffer pitch = %d bytes\n", dev->pitch);
+static void drm_free_dumb_buffer(int fd, struct drm_buffer_t *buf)
+{
+	struct drm_mode_destroy_dumb dreq = { .handle = buf->bo_handle };
+	struct drm_gem_close creq = { .handle = buf->bo_handle };
+
+	if (buf->buf)
+		munmap(buf->buf, buf->size);
+	if (buf->fb_id)
+		drmModeRmFB(fd, buf->fb_id);
+	if (buf->imported) {
+		drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &creq);
+		return;
+	}
+	if (buf->dmabuf_fd >= 0)
+		close(buf->dmabuf_fd);
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
 }
 
-void drm_setup_fb(int fd, struct drm_dev_t *dev, int map, int export)
+void drm_free_dumb(int fd, struct drm_buffer_t *bufs, int count)
 {
 	int i;
 
-	for (i = 0; i < BUFCOUNT; i++) {
-		uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
-		int ret;
+	for (i = 0; i < count; i++)
+		drm_free_dumb_buffer(fd, &bufs[i]);
+	free(bufs);
+}
+
+/*
+ * Replace buf with a new dumb buffer of width x height in format f,
+ * e.g. after a format change. buf must not be on screen.
+ */
+void drm_realloc_dumb(int fd, struct drm_buffer_t *buf, const struct format *f,
+		uint32_t width, uint32_t height, int map, int export)
+{
+	drm_free_dumb_buffer(fd, buf);
+	memset(buf, 0, sizeof(*buf));
+	drm_setup_buffer(fd, NULL, width, format_lines(f, height),
+			 f->cpp[0] * 8, buf, map, export);
+}
+
+/* All the planes of the format live in the same buffer */
+static void drm_add_fb(int fd, struct drm_dev_t *dev, struct drm_buffer_t *buf)
+{
+	const struct format *f = dev->format;
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+	int p;
+
+	format_layout(f, buf->pitch, dev->fb_height, pitches, offsets);
+	for (p = 0; p < f->planes; p++)
+		handles[p] = buf->bo_handle;
+	if (drmModeAddFB2(fd, dev->fb_width, dev->fb_height, f->drm_fourcc,
+			handles, pitches, offsets, &buf->fb_id, 0))
+		fatal("drmModeAddFB2 failed");
+}
+
+/*
+ * Recreate the framebuffer of buf for the current fb_width x fb_height
+ * and format of dev, keeping its memory. buf must not be on screen,
+ * removing the framebuffer would turn the plane off.
+ */
+void drm_update_fb(int fd, struct drm_dev_t *dev, struct drm_buffer_t *buf)
+{
+	if (buf->fb_id)
+		drmModeRmFB(fd, buf->fb_id);
+	buf->fb_id = 0;
+	drm_add_fb(fd, dev, buf);
+}
+
+/*
+ * Turn the CRTC on with dev->mode, routed to the connector, and show
+ * the first buffer on the plane, all in one atomic commit.
+ */
+static int drm_modeset_commit(int fd, struct drm_dev_t *dev)
+{
+	uint32_t *crtc_props = dev->crtc->prop_ids;
+	uint32_t conn_prop = dev->connector->prop_ids[CONNECTOR_CRTC_ID];
+	uint64_t *v = dev->commit.values;
+	drmModeAtomicReq *req;
+	uint32_t blob_id;
+	int i, ret;
+
+	if (!crtc_props[CRTC_ACTIVE] || !crtc_props[CRTC_MODE_ID] || !conn_prop)
+		return -EINVAL;
+	if (drmModeCreatePropertyBlob(fd, &dev->mode, sizeof(dev->mode), &blob_id))
+		return -errno;
+
+	req = drmModeAtomicAlloc();
+	drmModeAtomicAddProperty(req, dev->conn_id, conn_prop, dev->crtc_id);
+	drmModeAtomicAddProperty(req, dev->crtc_id, crtc_props[CRTC_MODE_ID], blob_id);
+	drmModeAtomicAddProperty(req, dev->crtc_id, crtc_props[CRTC_ACTIVE], 1);
+	v[PLANE_FB_ID] = dev->bufs[0].fb_id;
+	for (i = 0; i < PLANE_BASE_PROP_COUNT; i++)
+		drmModeAtomicAddProperty(req, dev->plane_id,
+				dev->plane->prop_ids[i], v[i]);
+
+	if (dev->viewport_dirty)
+		dev->viewport_dirty = VIEWPORT_SENT;
+	ret = drmModeAtomicCommit(fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	drm_viewport_done(dev, ret);
+	drmModeAtomicFree(req);
+
+	/* The CRTC keeps its own reference to the mode */
+	drmModeDestroyPropertyBlob(fd, blob_id);
+	return ret;
+}
 
-		drm_setup_buffer(fd, dev, dev->width, dev->height,
+static int drm_show_commit(int fd, struct drm_dev_t *dev, int modeset)
+{
+	if (modeset)
+		return drm_modeset_commit(fd, dev);
+	return drm_commit(fd, dev->bufs[0].fb_id, -1, NULL, dev, 0);
+}
+
+/* Show the first buffer on the plane, 0 on success */
+static int drm_show_plane(int fd, struct drm_dev_t *dev, int modeset)
+{
+	/* Not every plane can scale or be moved around */
+	drm_commit_set_rect(dev, 1);
+	if (!drm_show_commit(fd, dev, modeset))
+		return 0;
+	printf("DRM: plane %d cannot scale or center, showing the frames 1:1\n",
+		dev->plane_id);
+	drm_commit_set_rect(dev, 0);
+	return drm_show_commit(fd, dev, modeset);
+}
+
+/* Show the first buffer, modesetting only when the plane alone can't */
+void drm_show_fb(int fd, struct drm_dev_t *dev)
+{
+	if (!dev->saved_crtc)
+		dev->saved_crtc = drmModeGetCrtc(fd, dev->crtc_id); /* must store crtc data */
+
+	/* The CRTC already runs the mode, only the plane changes */
+	if (dev->adopted) {
+		if (!drm_show_plane(fd, dev, 0))
+			return;
+		printf("DRM: plane update refused, modesetting CRTC %d\n",
+			dev->crtc_id);
+	}
+
+	/* First buffer goes to DRM */
+	if (dev->plane->type == DRM_PLANE_TYPE_PRIMARY &&
+	    dev->fb_width >= dev->width && dev->fb_height >= dev->height) {
+		drm_commit_set_rect(dev, 0);
+		if (drmModeSetCrtc(fd, dev->crtc_id, dev->bufs[0].fb_id, 0, 0, &dev->conn_id, 1, &dev->mode))
+			fatal("drmModeSetCrtc() failed");
+		drm_viewport_done(dev, 0);
+		return;
+	}
+
+	/* Anything but a full-screen primary plane goes on top of what the
+	 * CRTC shows already, or lights the CRTC up along with the plane.
+	 */
+	if (dev->saved_crtc->mode_valid) {
+		if (drm_show_plane(fd, dev, 0))
+			fatal("could not show the first buffer");
+		return;
+	}
+	printf("DRM: CRTC %d is off, modesetting it with plane %d\n",
+		dev->crtc_id, dev->plane_id);
+	if (drm_show_plane(fd, dev, 1))
+		fatal("could not modeset the CRTC for the first buffer");
+}
+
+/*
+ * Allocate count framebuffers of fb_width x fb_height in dev->format,
+ * for drm_show_fb() to show the first one.
+ */
+void drm_setup_fb(int fd, struct drm_dev_t *dev, int count, int map, int export)
+{
+	const struct format *f = dev->format;
+	uint32_t width;
+	int i;
+
+	/* Wide enough for the pitch asked for */
+	width = dev->fb_width;
+	if (dev->fb_pitch / f->cpp[0] > width)
+		width = dev->fb_pitch / f->cpp[0];
+
+	drm_alloc_bufs(dev, count);
+	for (i = 0; i < count; i++) {
+		drm_setup_buffer(fd, dev, width,
+				 format_lines(f, dev->fb_height), f->cpp[0] * 8,
 				 &dev->bufs[i], map, export);
-                handles[0] = dev->bufs[i].bo_handle;
-                pitches[0] = dev->bufs[i].pitch;
-		ret = drmModeAddFB2(fd, dev->width, dev->height, DRM_FORMAT_ARGB8888,
-				handles, pitches, offsets, &dev->bufs[i].fb_id, 0);
-		if (ret)
-			fatal("drmModeAddFB2 failed");
+		drm_add_fb(fd, dev, &dev->bufs[i]);
 	}
 
 	/* Assume all buffers have the same pitch */
 	dev->pitch = dev->bufs[0].pitch;
-	printf("DRM: buffer pitch %d bytes\n", dev->pitch);
+	printf("DRM: %dx%d %s buffers, pitch %d bytes\n", dev->fb_width,
+		dev->fb_height, f->name, dev->pitch);
+}
 
-	dev->saved_crtc = drmModeGetCrtc(fd, dev->crtc_id); /* must store crtc data */
+/*
+ * Wrap count buffers allocated by someone else, e.g. the camera, in
+ * framebuffers of fb_width x fb_height in dev->format. The dmabufs
+ * stay owned by the exporter.
+ */
+void drm_import_fb(int fd, struct drm_dev_t *dev, int count,
+		const int *dmabuf_fds, uint32_t pitch)
+{
+	struct drm_buffer_t *buf;
+	uint32_t handle;
+	int i;
 
-	/* First buffer goes to DRM */
-	if (drmModeSetCrtc(fd, dev->crtc_id, dev->bufs[0].fb_id, 0, 0, &dev->conn_id, 1, &dev->mode))
-		fatal("drmModeSetCrtc() failed");
+	drm_alloc_bufs(dev, count);
+	for (i = 0; i < count; i++) {
+		buf = &dev->bufs[i];
+		if (drmPrimeFDToHandle(fd, dmabuf_fds[i], &handle))
+			fatal("could not import the V4L2 buffer");
+		buf->bo_handle = handle;
+		buf->dmabuf_fd = dmabuf_fds[i];
+		buf->imported = 1;
+		buf->pitch = pitch;
+		drm_add_fb(fd, dev, buf);
+	}
+
+	dev->pitch = pitch;
+	printf("DRM: imported %d %dx%d %s buffers, pitch %d bytes\n", count,
+		dev->fb_width, dev->fb_height, dev->format->name, pitch);
+}
+
+/*
+ * A device without hardware behind it, for the mock backend: made up
+ * object and property IDs, and count framebuffers with IDs 1 to count.
+ */
+struct drm_dev_t *drm_mock_dev(uint32_t plane_id, uint32_t crtc_id,
+		uint32_t width, uint32_t height, int count)
+{
+	struct drm_dev_t *dev;
+	int i;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		fatal("cannot allocate the mock device");
+	dev->plane = calloc(1, sizeof(*dev->plane));
+	dev->crtc = calloc(1, sizeof(*dev->crtc));
+	dev->connector = calloc(1, sizeof(*dev->connector));
+	if (!dev->plane || !dev->crtc || !dev->connector)
+		fatal("cannot allocate the mock device");
+
+	dev->conn_id = crtc_id;
+	dev->crtc_id = crtc_id;
+	dev->plane_id = plane_id;
+	dev->width = dev->fb_width = width;
+	dev->height = dev->fb_height = height;
+	dev->pitch = width * 4;
+	dev->format = format_from_drm(DRM_FORMAT_XRGB8888);
+	dev->v4l2_fd = dev->drm_fd = -1;
+
+	dev->plane->type = DRM_PLANE_TYPE_PRIMARY;
+	for (i = 0; i < PLANE_PROP_COUNT; i++)
+		dev->plane->prop_ids[i] = 1 + i;
+	for (i = 0; i < CRTC_PROP_COUNT; i++)
+		dev->crtc->prop_ids[i] = 1 + PLANE_PROP_COUNT + i;
+	drm_layout_commit(dev);
+
+	drm_alloc_bufs(dev, count);
+	for (i = 0; i < count; i++) {
+		dev->bufs[i].fb_id = 1 + i;
+		dev->bufs[i].dmabuf_fd = -1;
+		dev->bufs[i].pitch = dev->pitch;
+	}
+	return dev;
+}
+
+#ifndef DRM_IOCTL_MODE_CLOSEFB
+struct drm_mode_closefb {
+	uint32_t fb_id;
+	uint32_t pad;
+};
+#define DRM_IOCTL_MODE_CLOSEFB DRM_IOWR(0xD0, struct drm_mode_closefb)
+#endif
+
+/*
+ * Close the framebuffer on screen without disabling the plane, so it
+ * stays up until the next client takes over. Returns 1 if it did,
+ * 0 on kernels without CLOSEFB (before 6.8).
+ */
+static int drm_close_fb(int fd, struct drm_dev_t *dev)
+{
+	struct drm_mode_closefb req = { 0 };
+	int i;
+
+	for (i = 0; i < dev->buf_count; i++)
+		if (dev->bufs[i].fb_id == dev->commit.values[PLANE_FB_ID])
+			break;
+	if (i == dev->buf_count)
+		return 0;
+
+	req.fb_id = dev->bufs[i].fb_id;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CLOSEFB, &req))
+		return 0;
+	/* The GEM object lives on as long as the plane scans it out */
+	dev->bufs[i].fb_id = 0;
+	return 1;
 }
 
 void drm_destroy(int fd, struct drm_dev_t *dev_head)
 {
 	struct drm_dev_t *devp, *devp_tmp;
-	int i;
 
 	for (devp = dev_head; devp != NULL;) {
-		if (devp->saved_crtc) {
+		/* Leave the last frame up rather than blank the display */
+		if (!(devp->adopted && drm_close_fb(fd, devp)) && devp->saved_crtc)
 			drmModeSetCrtc(fd, devp->saved_crtc->crtc_id, devp->saved_crtc->buffer_id,
 				devp->saved_crtc->x, devp->saved_crtc->y, &devp->conn_id, 1, &devp->saved_crtc->mode);
-			drmModeFreeCrtc(devp->saved_crtc);
-		}
 
-		for (i = 0; i < BUFCOUNT; i++) {
-			struct drm_mode_destroy_dumb dreq = { .handle = devp->bufs[i].bo_handle };
-
-			if (devp->bufs[i].buf)
-				munmap(devp->bufs[i].buf, devp->bufs[i].size);
-			if (devp->bufs[i].dmabuf_fd >= 0)
-				close(devp->bufs[i].dmabuf_fd);
-			drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-			drmModeRmFB(fd, devp->bufs[i].fb_id);
-		}
+		drm_free_dumb(fd, devp->bufs, devp->buf_count);
 
 		devp_tmp = devp;
 		devp = devp->next;
-		free(devp_tmp);
+		drm_free_dev(devp_tmp);
 	}
 
 	close(fd);
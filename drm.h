@@ -5,25 +5,107 @@
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include "format.h"
 
+/* Default depth of the buffer ring, see drm_setup_fb() */
 #define BUFCOUNT 3
+#define BUFCOUNT_MIN 2
+#define BUFCOUNT_MAX 16
+
+/* Property IDs resolved once in drm_init(), 0 if not supported */
+enum plane_prop {
+	PLANE_FB_ID = 0,
+	PLANE_CRTC_ID,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	/* Optional properties below */
+	PLANE_IN_FENCE_FD,
+	PLANE_PROP_COUNT
+};
+
+#define PLANE_BASE_PROP_COUNT PLANE_IN_FENCE_FD
+
+/* ACTIVE and MODE_ID, with the connector CRTC_ID, turn a CRTC on */
+enum crtc_prop {
+	CRTC_ACTIVE = 0,
+	CRTC_MODE_ID,
+	CRTC_OUT_FENCE_PTR,
+	CRTC_PROP_COUNT
+};
+
+enum connector_prop {
+	CONNECTOR_CRTC_ID = 0,
+	CONNECTOR_PROP_COUNT
+};
 
 struct plane {
 	drmModePlane *plane;
 	drmModeObjectProperties *props;
-	drmModePropertyRes **props_info;
+	uint32_t prop_ids[PLANE_PROP_COUNT];
+	/* DRM_PLANE_TYPE_* */
+	int type;
 };
 
 struct crtc {
 	drmModeCrtc *crtc;
 	drmModeObjectProperties *props;
-	drmModePropertyRes **props_info;
+	uint32_t prop_ids[CRTC_PROP_COUNT];
 };
 
 struct connector {
 	drmModeConnector *connector;
 	drmModeObjectProperties *props;
-	drmModePropertyRes **props_info;
+	uint32_t prop_ids[CONNECTOR_PROP_COUNT];
+};
+
+/*
+ * Atomic request prepared in drm_init(): the plane and CRTC objects
+ * with their property IDs and values, laid out as DRM_IOCTL_MODE_ATOMIC
+ * expects them. Flipping only patches values, so a commit doesn't
+ * allocate nor look up properties by name.
+ */
+struct drm_commit_t {
+	struct drm_mode_atomic atomic;
+	uint32_t objs[2];
+	uint32_t count_props[2];
+	uint32_t props[PLANE_PROP_COUNT + CRTC_PROP_COUNT];
+	uint64_t values[PLANE_PROP_COUNT + CRTC_PROP_COUNT];
+};
+
+/* A rectangle in pixels, on the framebuffer or on the display */
+struct drm_rect {
+	int32_t x, y;
+	uint32_t w, h;
+};
+
+#define PLANE_RECT_COUNT (PLANE_CRTC_H - PLANE_SRC_X + 1)
+
+/*
+ * Flips of several drm_dev_t sent as one atomic request, e.g. one per
+ * vblank for all the displays, instead of one ioctl per plane. It's
+ * built by concatenating the prepared requests of each device.
+ */
+#define DRM_BATCH_MAX 8
+
+struct drm_batch_t {
+	struct drm_mode_atomic atomic;
+	struct drm_dev_t *devs[DRM_BATCH_MAX];
+	int count;
+
+	uint32_t count_objs, count_values;
+	uint32_t objs[2 * DRM_BATCH_MAX];
+	uint32_t count_props[2 * DRM_BATCH_MAX];
+	uint32_t props[DRM_BATCH_MAX * (PLANE_PROP_COUNT + CRTC_PROP_COUNT)];
+	uint64_t values[DRM_BATCH_MAX * (PLANE_PROP_COUNT + CRTC_PROP_COUNT)];
+
+	/* Ioctls issued, flips they carried and failed ioctls */
+	unsigned long commits, updates, failures;
 };
 
 struct drm_buffer_t {
@@ -33,6 +115,8 @@ struct drm_buffer_t {
 	int dmabuf_fd;
 	int bo_handle;
 	uint32_t *buf;
+	/* Imported from dmabuf_fd, which belongs to the exporter */
+	int imported;
 };
 
 struct drm_dev_t {
@@ -40,17 +124,39 @@ struct drm_dev_t {
 	int crtc_index;
 	uint32_t width, height, pitch;
 	drmModeModeInfo mode;
+
+	/* Framebuffers, set before drm_setup_fb(). The pitch is a
+	 * minimum, 0 lets the driver choose.
+	 */
+	const struct format *format;
+	uint32_t fb_width, fb_height, fb_pitch;
+
 	drmModeCrtc *saved_crtc;
+	/* Kept the mode saved_crtc was running, no modeset in or out */
+	int adopted;
 	struct drm_dev_t *next;
 
 	struct plane *plane;
 	struct crtc *crtc;
 	struct connector *connector;
+	struct drm_commit_t commit;
+
+	/*
+	 * The plane SRC and CRTC rectangles live in commit, so a new
+	 * viewport goes along with the next flip. viewport_shown has the
+	 * last ones the kernel accepted, restored if it rejects new ones.
+	 */
+	enum { VIEWPORT_SHOWN = 0, VIEWPORT_PENDING, VIEWPORT_SENT } viewport_dirty;
+	uint64_t viewport_shown[PLANE_RECT_COUNT];
 
 	int v4l2_fd;
 	int drm_fd;
 
-	struct drm_buffer_t bufs[BUFCOUNT];
+	/* Owner of the device, e.g. the pipeline it is part of */
+	void *priv;
+
+	struct drm_buffer_t *bufs;
+	int buf_count;
 };
 
 inline static void fatal(char *str)
@@ -66,9 +172,33 @@ inline static void error(char *str)
 }
 
 int drm_open(const char *path, int need_dumb, int need_prime);
-struct drm_dev_t *drm_init(int fd);
-void drm_setup_dummy(int fd, struct drm_dev_t *dev, int map, int export);
-void drm_setup_fb(int fd, struct drm_dev_t *dev, int map, int export);
+struct drm_dev_t *drm_init(int fd, int adopt);
+void drm_setup_fb(int fd, struct drm_dev_t *dev, int count, int map, int export);
+void drm_import_fb(int fd, struct drm_dev_t *dev, int count,
+		const int *dmabuf_fds, uint32_t pitch);
+void drm_show_fb(int fd, struct drm_dev_t *dev);
+struct drm_dev_t *drm_mock_dev(uint32_t plane_id, uint32_t crtc_id,
+		uint32_t width, uint32_t height, int count);
 void drm_destroy(int fd, struct drm_dev_t *dev_head);
-void drm_render_atomic(int drm_fd, int fb_id, struct drm_dev_t *dev);
-void drm_render_legacy(int drm_fd, int fb_id, struct drm_dev_t *dev);
+struct drm_buffer_t *drm_alloc_dumb(int fd, int count, const struct format *f,
+		uint32_t width, uint32_t height, int map, int export);
+void drm_free_dumb(int fd, struct drm_buffer_t *bufs, int count);
+void drm_realloc_dumb(int fd, struct drm_buffer_t *buf, const struct format *f,
+		uint32_t width, uint32_t height, int map, int export);
+void drm_update_fb(int fd, struct drm_dev_t *dev, struct drm_buffer_t *buf);
+const struct format *drm_select_format(int fd, struct drm_dev_t *dev_head,
+		struct drm_dev_t *dev, const uint32_t *v4l2_fourccs, int count);
+int drm_has_fences(struct drm_dev_t *dev);
+void drm_rect_fit(uint32_t w, uint32_t h, uint32_t area_w, uint32_t area_h,
+		int upscale, struct drm_rect *r);
+void drm_set_viewport(struct drm_dev_t *dev, const struct drm_rect *src,
+		const struct drm_rect *dst);
+void drm_set_zoom(struct drm_dev_t *dev, unsigned int zoom,
+		uint32_t cx, uint32_t cy);
+int drm_render_async(int drm_fd, int fb_id, int in_fence_fd,
+		int *out_fence_fd, struct drm_dev_t *dev);
+int drm_batch_add(struct drm_batch_t *batch, int fb_id, int in_fence_fd,
+		int *out_fence_fd, struct drm_dev_t *dev);
+int drm_batch_commit(int drm_fd, struct drm_batch_t *batch);
+void drm_batch_reset(struct drm_batch_t *batch);
+void drm_bench_commit(int drm_fd, int fb_id, struct drm_dev_t *dev, int count);
@@ -0,0 +1,79 @@
+#include <stddef.h>
+#include <string.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "videodev2.h"
+#include "format.h"
+
+const struct format formats[] = {
+	{ "NV12", V4L2_PIX_FMT_NV12, DRM_FORMAT_NV12, 1, 2, { 1, 2 }, 2, 2 },
+	{ "YUYV", V4L2_PIX_FMT_YUYV, DRM_FORMAT_YUYV, 1, 1, { 2 }, 1, 1 },
+	{ "UYVY", V4L2_PIX_FMT_UYVY, DRM_FORMAT_UYVY, 1, 1, { 2 }, 1, 1 },
+	{ "NV16", V4L2_PIX_FMT_NV16, DRM_FORMAT_NV16, 1, 2, { 1, 2 }, 2, 1 },
+	{ "XRGB8888", V4L2_PIX_FMT_XBGR32, DRM_FORMAT_XRGB8888, 0, 1, { 4 }, 1, 1 },
+	/* Deprecated V4L2 name of the same layout, older drivers only list it */
+	{ "BGR32", V4L2_PIX_FMT_BGR32, DRM_FORMAT_XRGB8888, 0, 1, { 4 }, 1, 1 },
+	{ "RGB565", V4L2_PIX_FMT_RGB565, DRM_FORMAT_RGB565, 0, 1, { 2 }, 1, 1 },
+};
+
+const int format_count = sizeof(formats) / sizeof(formats[0]);
+
+const struct format *format_from_v4l2(uint32_t fourcc)
+{
+	int i;
+
+	for (i = 0; i < format_count; i++)
+		if (formats[i].v4l2_fourcc == fourcc)
+			return &formats[i];
+	return NULL;
+}
+
+/* The first match: XRGB8888 maps to V4L2 XBGR32, not BGR32 */
+const struct format *format_from_drm(uint32_t fourcc)
+{
+	int i;
+
+	for (i = 0; i < format_count; i++)
+		if (formats[i].drm_fourcc == fourcc)
+			return &formats[i];
+	return NULL;
+}
+
+const struct format *format_from_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < format_count; i++)
+		if (!strcmp(formats[i].name, name))
+			return &formats[i];
+	return NULL;
+}
+
+/*
+ * Pitch and offset of each plane, as drmModeAddFB2() wants them, for
+ * a buffer whose first plane has the given pitch.
+ */
+void format_layout(const struct format *f, uint32_t pitch, uint32_t height,
+		uint32_t pitches[4], uint32_t offsets[4])
+{
+	int i;
+
+	pitches[0] = pitch;
+	offsets[0] = 0;
+	for (i = 1; i < f->planes; i++) {
+		pitches[i] = pitch / f->hsub * f->cpp[i] / f->cpp[0];
+		offsets[i] = offsets[i - 1] + pitches[i - 1] *
+			(i == 1 ? height : height / f->vsub);
+	}
+}
+
+/* Height of the buffer, in lines of the first plane */
+uint32_t format_lines(const struct format *f, uint32_t height)
+{
+	uint32_t lines = height;
+	int i;
+
+	for (i = 1; i < f->planes; i++)
+		lines += height / f->vsub * f->cpp[i] / f->cpp[0] / f->hsub;
+	return lines;
+}
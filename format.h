@@ -0,0 +1,36 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+
+#define FORMAT_MAX_PLANES 3
+
+/*
+ * A pixel format known to both V4L2 and DRM, with its memory layout.
+ * Single-planar V4L2 formats keep all the planes in one buffer, one
+ * after the other, which is what the layout describes.
+ */
+struct format {
+	const char *name;
+	uint32_t v4l2_fourcc;
+	uint32_t drm_fourcc;
+	int yuv;
+
+	/* Bytes per pixel of each plane, chroma planes are subsampled */
+	int planes;
+	int cpp[FORMAT_MAX_PLANES];
+	int hsub, vsub;
+};
+
+/* In order of preference, native YUV first */
+extern const struct format formats[];
+extern const int format_count;
+
+const struct format *format_from_v4l2(uint32_t fourcc);
+const struct format *format_from_drm(uint32_t fourcc);
+const struct format *format_from_name(const char *name);
+void format_layout(const struct format *f, uint32_t pitch, uint32_t height,
+		uint32_t pitches[4], uint32_t offsets[4]);
+uint32_t format_lines(const struct format *f, uint32_t height);
+
+#endif /* FORMAT_H */
@@ -0,0 +1,83 @@
+#include <stdio.h>
+
+#include "hist.h"
+
+static unsigned int hist_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) +
+		((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/* Middle of the range of values falling in bucket index */
+static uint64_t hist_value(unsigned int index)
+{
+	unsigned int shift;
+	uint64_t mantissa;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	shift = (index >> HIST_SUB_BITS) - 1;
+	mantissa = HIST_SUB_COUNT + (index & (HIST_SUB_COUNT - 1));
+	return (mantissa << shift) + ((1ull << shift) >> 1);
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&h->buckets[hist_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t hist_percentile(struct hist *h, double percentile)
+{
+	uint64_t total = 0, seen = 0, target;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+	if (!total)
+		return 0;
+
+	/* Rank of the sample, rounded up, in 0.1 percent steps */
+	target = (total * (uint64_t)(percentile * 10) + 999) / 1000;
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			break;
+	}
+
+	return hist_value(i);
+}
+
+void hist_print(struct hist *h, const char *unit, uint64_t divider)
+{
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+	if (!count) {
+		printf("%-18s no samples\n", h->name);
+		return;
+	}
+
+	printf("%-18s n=%-8llu p50=%.1f%s p99=%.1f%s p99.9=%.1f%s max=%.1f%s\n",
+		h->name, (unsigned long long)count,
+		(double)hist_percentile(h, 50.0) / divider, unit,
+		(double)hist_percentile(h, 99.0) / divider, unit,
+		(double)hist_percentile(h, 99.9) / divider, unit,
+		(double)__atomic_load_n(&h->max, __ATOMIC_RELAXED) / divider, unit);
+}
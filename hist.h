@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+/*
+ * Log-linear (HDR-style) histogram: values below 2^HIST_SUB_BITS get
+ * their own bucket, larger ones are split in 2^HIST_SUB_BITS buckets
+ * per power of two, so the relative error stays around 3%.
+ *
+ * hist_record() only does relaxed atomic increments, so a histogram
+ * can be read while another thread, or a signal, records into it.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+	const char *name;
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_record(struct hist *h, uint64_t value);
+uint64_t hist_percentile(struct hist *h, double percentile);
+void hist_print(struct hist *h, const char *unit, uint64_t divider);
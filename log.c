@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+
+#include "log.h"
+
+/* Must be a power of two */
+#define LOG_RING_SIZE	1024
+#define LOG_MAX_ARGS	12
+/* Room for the %s and %m strings of a message */
+#define LOG_TEXT_SIZE	128
+#define LOG_LINE_SIZE	512
+
+/* Errors and warnings past LOG_BURST per window and call site are counted */
+#define LOG_BURST	10
+#define LOG_WINDOW_NS	1000000000ull
+
+union log_arg {
+	long long i;
+	unsigned long long u;
+	double d;
+	const void *p;
+};
+
+/*
+ * A slot is free for the producer at position pos when its sequence
+ * is pos, and holds a record for the consumer when it is pos + 1.
+ * seq is stored minus the slot index, so the zeroed ring starts with
+ * every slot free for the first lap, before log_start() runs.
+ */
+struct log_record {
+	unsigned long seq;
+	struct log_site *site;
+	const char *fmt;
+	unsigned long suppressed;
+	int count;
+	union log_arg args[LOG_MAX_ARGS];
+	char text[LOG_TEXT_SIZE];
+};
+
+static struct log_record ring[LOG_RING_SIZE];
+static unsigned long tail;
+static unsigned long head;
+
+static unsigned long written, dropped, suppressed;
+static unsigned long dropped_told;
+
+static pthread_t thread;
+static int running, stopping;
+
+/*
+ * The logger blocks on wake_fd once the ring is empty, after setting
+ * sleeping. Only the first message after that pays for a write().
+ */
+static int wake_fd = -1;
+static int sleeping;
+
+/* A printf conversion, what it takes from the arguments */
+struct log_spec {
+	const char *start, *end;
+	int star_width, star_precision;
+	char length[3];
+	char conv;
+};
+
+/* Parses the conversion at p, just past its '%' */
+static const char *log_spec(const char *p, struct log_spec *s)
+{
+	size_t n;
+
+	s->start = p - 1;
+	p += strspn(p, "-+ #0'");
+	s->star_width = *p == '*';
+	p += s->star_width ? 1 : strspn(p, "0123456789");
+	s->star_precision = 0;
+	if (*p == '.') {
+		p++;
+		s->star_precision = *p == '*';
+		p += s->star_precision ? 1 : strspn(p, "0123456789");
+	}
+	n = strspn(p, "hlzjt");
+	if (n > 2)
+		n = 2;
+	memcpy(s->length, p, n);
+	s->length[n] = '\0';
+	p += n;
+	s->conv = *p;
+	s->end = *p ? p + 1 : p;
+	return s->end;
+}
+
+static long long arg_signed(const char *length, va_list *ap)
+{
+	if (!strcmp(length, "l"))
+		return va_arg(*ap, long);
+	if (!strcmp(length, "ll"))
+		return va_arg(*ap, long long);
+	if (!strcmp(length, "z"))
+		return va_arg(*ap, ssize_t);
+	if (!strcmp(length, "j"))
+		return va_arg(*ap, intmax_t);
+	if (!strcmp(length, "t"))
+		return va_arg(*ap, ptrdiff_t);
+	return va_arg(*ap, int);
+}
+
+static unsigned long long arg_unsigned(const char *length, va_list *ap)
+{
+	if (!strcmp(length, "l"))
+		return va_arg(*ap, unsigned long);
+	if (!strcmp(length, "ll"))
+		return va_arg(*ap, unsigned long long);
+	if (!strcmp(length, "z"))
+		return va_arg(*ap, size_t);
+	if (!strcmp(length, "j"))
+		return va_arg(*ap, uintmax_t);
+	if (!strcmp(length, "t"))
+		return va_arg(*ap, ptrdiff_t);
+	return va_arg(*ap, unsigned int);
+}
+
+/* Copy str into the record, args hold the offset */
+static void capture_text(struct log_record *r, size_t *used,
+		union log_arg *arg, const char *str)
+{
+	size_t len;
+
+	if (!str)
+		str = "(null)";
+	len = strlen(str);
+	if (len > LOG_TEXT_SIZE - *used - 1)
+		len = LOG_TEXT_SIZE - *used - 1;
+	memcpy(r->text + *used, str, len);
+	r->text[*used + len] = '\0';
+	arg->u = *used;
+	*used += len + 1;
+}
+
+/*
+ * Take the arguments as the format says, by value: strings may be gone
+ * by the time the logger thread formats them.
+ */
+static void capture(struct log_record *r, const char *fmt, va_list *ap,
+		int err)
+{
+	const char *p = fmt;
+	struct log_spec s;
+	size_t used = 0;
+	int n = 0;
+
+	while ((p = strchr(p, '%')) && n < LOG_MAX_ARGS) {
+		if (p[1] == '%') {
+			p += 2;
+			continue;
+		}
+		p = log_spec(p + 1, &s);
+		if (s.star_width)
+			r->args[n++].i = va_arg(*ap, int);
+		if (s.star_precision && n < LOG_MAX_ARGS)
+			r->args[n++].i = va_arg(*ap, int);
+		if (n == LOG_MAX_ARGS)
+			break;
+
+		switch (s.conv) {
+		case 'd': case 'i': case 'c':
+			r->args[n].i = arg_signed(s.length, ap);
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			r->args[n].u = arg_unsigned(s.length, ap);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			r->args[n].d = va_arg(*ap, double);
+			break;
+		case 's':
+			capture_text(r, &used, &r->args[n], va_arg(*ap, const char *));
+			break;
+		case 'm':
+			capture_text(r, &used, &r->args[n], strerror(err));
+			break;
+		case 'p': case 'n':
+			r->args[n].p = va_arg(*ap, void *);
+			break;
+		default:
+			/* Unknown, the rest is written as is */
+			r->count = n;
+			return;
+		}
+		n++;
+	}
+	r->count = n;
+}
+
+/* Returns 1 if the message is over the budget of its call site */
+static int rate_limited(struct log_site *site, unsigned long *held_back)
+{
+	struct timespec ts;
+	uint64_t now, start;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	start = __atomic_load_n(&site->window_ns, __ATOMIC_RELAXED);
+
+	if (!start || now - start >= LOG_WINDOW_NS) {
+		if (__atomic_compare_exchange_n(&site->window_ns, &start, now,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			__atomic_store_n(&site->burst, 0, __ATOMIC_RELAXED);
+	}
+	if (__atomic_add_fetch(&site->burst, 1, __ATOMIC_RELAXED) <= LOG_BURST) {
+		*held_back = __atomic_exchange_n(&site->suppressed, 0,
+				__ATOMIC_RELAXED);
+		return 0;
+	}
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&suppressed, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void log_wake(void)
+{
+	uint64_t one = 1;
+
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+		return;
+}
+
+void log_push(struct log_site *site, const char *fmt, ...)
+{
+	const unsigned long mask = LOG_RING_SIZE - 1;
+	int err = errno;
+	unsigned long pos, seq, held_back = 0;
+	struct log_record *r;
+	va_list ap;
+	long diff;
+
+	if (site->level <= LOG_WARN && rate_limited(site, &held_back))
+		goto out;
+
+	pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	while (1) {
+		r = &ring[pos & mask];
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) + (pos & mask);
+		diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Full, the logger is behind */
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			if (held_back)
+				__atomic_add_fetch(&site->suppressed, held_back,
+						__ATOMIC_RELAXED);
+			goto out;
+		} else {
+			pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	r->site = site;
+	r->fmt = fmt;
+	r->suppressed = held_back;
+	va_start(ap, fmt);
+	capture(r, fmt, &ap, err);
+	va_end(ap);
+	__atomic_store_n(&r->seq, pos + 1 - (pos & mask), __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in log_thread(), before it checks the ring */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED))
+		log_wake();
+out:
+	errno = err;
+}
+
+/* Format one conversion of r, '*' replaced by the captured values */
+static int format_spec(struct log_record *r, const struct log_spec *s,
+		int *n, char *out, size_t size)
+{
+	char conv[32];
+	size_t len = 0;
+	const char *p;
+	union log_arg a;
+
+	for (p = s->start; p < s->end && len < sizeof(conv) - 12; p++) {
+		if (*p == '*')
+			len += sprintf(conv + len, "%d", (int)r->args[(*n)++].i);
+		else
+			conv[len++] = *p == 'm' ? 's' : *p;
+	}
+	conv[len] = '\0';
+	if (*n >= r->count)
+		return 0;
+	a = r->args[(*n)++];
+
+	switch (s->conv) {
+	case 'd': case 'i': case 'c':
+		if (!strcmp(s->length, "ll") || !strcmp(s->length, "j"))
+			return snprintf(out, size, conv, (long long)a.i);
+		if (s->length[0] && s->length[0] != 'h')
+			return snprintf(out, size, conv, (long)a.i);
+		return snprintf(out, size, conv, (int)a.i);
+	case 'u': case 'o': case 'x': case 'X':
+		if (!strcmp(s->length, "ll") || !strcmp(s->length, "j"))
+			return snprintf(out, size, conv, (unsigned long long)a.u);
+		if (s->length[0] && s->length[0] != 'h')
+			return snprintf(out, size, conv, (unsigned long)a.u);
+		return snprintf(out, size, conv, (unsigned int)a.u);
+	case 's': case 'm':
+		return snprintf(out, size, conv, r->text + a.u);
+	case 'p':
+		return snprintf(out, size, conv, a.p);
+	case 'n':
+		return 0;
+	default:
+		return snprintf(out, size, conv, a.d);
+	}
+}
+
+static void format(struct log_record *r, char *out, size_t size)
+{
+	const char *p = r->fmt;
+	struct log_spec s;
+	size_t len = 0;
+	int n = 0, ret;
+
+	while (*p && len < size - 1) {
+		if (p[0] == '%' && p[1] == '%') {
+			out[len++] = '%';
+			p += 2;
+			continue;
+		}
+		if (*p != '%' || n >= r->count) {
+			out[len++] = *p++;
+			continue;
+		}
+		p = log_spec(p + 1, &s);
+		ret = format_spec(r, &s, &n, out + len, size - len);
+		if (ret > 0)
+			len += (size_t)ret < size - len ? (size_t)ret : size - len - 1;
+	}
+	out[len] = '\0';
+}
+
+/* Returns 1 if the next record is ready for the logger */
+static int ready(void)
+{
+	const unsigned long mask = LOG_RING_SIZE - 1;
+	unsigned long seq;
+
+	seq = __atomic_load_n(&ring[head & mask].seq, __ATOMIC_ACQUIRE) +
+		(head & mask);
+	return seq == head + 1;
+}
+
+/* Write what the ring holds, returns how many messages that was */
+static int drain(void)
+{
+	const unsigned long mask = LOG_RING_SIZE - 1;
+	char line[LOG_LINE_SIZE];
+	struct log_record *r;
+	unsigned long lost;
+	FILE *f;
+	int n = 0;
+
+	while (ready()) {
+		r = &ring[head & mask];
+
+		format(r, line, sizeof(line));
+		f = r->site->level == LOG_ERROR ? stderr : stdout;
+		fputs(line, f);
+		if (r->suppressed)
+			fprintf(f, "(%lu more like it suppressed)\n", r->suppressed);
+
+		__atomic_store_n(&r->seq, head + LOG_RING_SIZE - (head & mask),
+				__ATOMIC_RELEASE);
+		head++;
+		n++;
+	}
+
+	lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (lost != dropped_told) {
+		fprintf(stderr, "log: %lu messages dropped\n", lost - dropped_told);
+		dropped_told = lost;
+	}
+	if (n) {
+		written += n;
+		fflush(stdout);
+	}
+	return n;
+}
+
+static void *log_thread(void *arg)
+{
+	uint64_t count;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (drain())
+			continue;
+
+		__atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		/* A message may have come before producers saw sleeping */
+		if (ready() || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+			break;
+		__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+	}
+	drain();
+	return NULL;
+}
+
+/* Messages logged before are kept, up to the ring size */
+void log_start(void)
+{
+	if (running)
+		return;
+	wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		perror("logger eventfd");
+		return;
+	}
+	if (pthread_create(&thread, NULL, log_thread, NULL)) {
+		fprintf(stderr, "cannot create the logger thread\n");
+		close(wake_fd);
+		wake_fd = -1;
+		return;
+	}
+	pthread_setname_np(thread, "logger");
+	running = 1;
+	atexit(log_stop);
+}
+
+/* Writes whatever is left, also called at exit */
+void log_stop(void)
+{
+	if (running && !pthread_equal(thread, pthread_self())) {
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		/* wake_fd stays open for producers that saw sleeping */
+		log_wake();
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+	if (!running)
+		drain();
+}
+
+void log_print(void)
+{
+	printf("log: %lu written, %lu dropped, %lu suppressed\n",
+		__atomic_load_n(&written, __ATOMIC_RELAXED),
+		__atomic_load_n(&dropped, __ATOMIC_RELAXED),
+		__atomic_load_n(&suppressed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,50 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+/*
+ * Logging that stays off the frame path: log_*() only copy the format
+ * and its arguments into a lock-free ring, the logger thread formats
+ * and writes them. Messages above LOG_LEVEL compile to nothing.
+ * Errors and warnings are rate limited per call site, and a full ring
+ * drops messages, both counted exactly.
+ */
+#define LOG_ERROR	0
+#define LOG_WARN	1
+#define LOG_INFO	2
+#define LOG_DEBUG	3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL	LOG_DEBUG
+#endif
+
+/* One per call site, private to log.c */
+struct log_site {
+	int level;
+	uint64_t window_ns;
+	unsigned int burst;
+	unsigned long suppressed;
+};
+
+void log_push(struct log_site *site, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#define log_at(lvl, fmt, arg...)					\
+do {									\
+	if ((lvl) <= LOG_LEVEL) {					\
+		static struct log_site log_site_ = { .level = (lvl) };	\
+		log_push(&log_site_, fmt, ## arg);			\
+	}								\
+} while (0)
+
+#define log_error(fmt, arg...)	log_at(LOG_ERROR, fmt, ## arg)
+#define log_warn(fmt, arg...)	log_at(LOG_WARN, fmt, ## arg)
+#define log_info(fmt, arg...)	log_at(LOG_INFO, fmt, ## arg)
+#define log_debug(fmt, arg...)	log_at(LOG_DEBUG, fmt, ## arg)
+
+void log_start(void);
+void log_stop(void);
+void log_print(void);
+
+#endif /* LOG_H */
@@ -1,201 +1,2498 @@
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include "videodev2.h"
 #include "drm.h"
 #include "v4l2.h"
+#include "sync.h"
+#include "hist.h"
+#include "spsc.h"
+#include "convert.h"
+#include "pool.h"
+#include "dmabuf.h"
+#include "devops.h"
+#include "mock.h"
+#include "log.h"
+#include "shmstats.h"
+
+#define MAX_PIPELINES 4
 
 static const char *dri_path = "/dev/dri/card0";
-static const char *v4l2_path = "/dev/video0";
-static struct buffer buffers[BUFCOUNT];
-static struct buffer *front_buffer, *back_buffer;
+static const char *v4l2_paths[MAX_PIPELINES] = { "/dev/video0" };
+static int buffer_count = BUFCOUNT;
+/* 0 picks the smallest size covering the display */
+static int capture_width, capture_height;
+/* NULL picks the best format both devices support */
+static const struct format *capture_format;
+/* Digital zoom in percent, SIGUSR2 doubles it up to ZOOM_MAX */
+static unsigned int zoom = 100;
+#define ZOOM_MAX 800
 static int debug = 1;
+/* Run for that long, 0 until interrupted, then write stats there */
+static unsigned int run_seconds;
+static const char *json_path;
 
-#define error(fmt, arg...)		\
-do {					\
-	printf("ERROR: " fmt, ## arg);	\
-} while (0);				\
+/* FIFO of buffers, sized to hold all of them */
+struct buffer_ring {
+	struct buffer **slots;
+	int head, count, size;
+};
+
+/*
+ * What to do with a frame captured while the display is busy:
+ * FIFO queues it, MAILBOX replaces the pending frame with it and
+ * IMMEDIATE does the same, but flips without waiting for vblank.
+ */
+enum present_mode {
+	PRESENT_FIFO = 0,
+	PRESENT_MAILBOX,
+	PRESENT_IMMEDIATE,
+	PRESENT_MODE_COUNT
+};
+
+static const char * const present_mode_names[PRESENT_MODE_COUNT] = {
+	[PRESENT_FIFO]		= "fifo",
+	[PRESENT_MAILBOX]	= "mailbox",
+	[PRESENT_IMMEDIATE]	= "immediate",
+};
+
+struct present_stats {
+	unsigned long presented;
+	unsigned long dropped;
+	uint64_t latency_ns;
+	uint64_t latency_max_ns;
+};
+
+/* Per-frame latency between the timestamps carried by struct buffer */
+enum latency_span {
+	LAT_CAPTURE_DEQUEUE = 0,
+	LAT_DEQUEUE_COMMIT,
+	LAT_COMMIT_FLIP,
+	LAT_CAPTURE_FLIP,
+	LAT_COUNT
+};
+
+static const char * const latency_names[LAT_COUNT] = {
+	[LAT_CAPTURE_DEQUEUE]	= "capture->dequeue",
+	[LAT_DEQUEUE_COMMIT]	= "dequeue->commit",
+	[LAT_COMMIT_FLIP]	= "commit->flip",
+	[LAT_CAPTURE_FLIP]	= "capture->flip",
+};
+
+/* Exit when no frame was captured for that long */
+#define CAPTURE_TIMEOUT_NS	3000000000ull
+/* Warn when a flip takes longer than that */
+#define FLIP_TIMEOUT_NS		1000000000ull
+#define WATCHDOG_PERIOD_S	1
+/* Staged flips are committed that long before the vblank they target */
+#define BATCH_MARGIN_NS		2000000ull
+
+/*
+ * Two-thread mode: the capture thread dequeues and hands buffers over
+ * through the ring, signaling captured_fd. The main thread is the
+ * display thread and gives buffers back to V4L by queueing them.
+ */
+struct capture_thread {
+	pthread_t thread;
+	struct spsc_ring ring;
+	int captured_fd;
+	int stop_fd;
+	/* Written once a buffer is queued while the thread is starved */
+	int queued_fd;
+	int starved;
+};
+
+/*
+ * A camera -> display pipeline: one V4L2 device feeding one
+ * drm_dev_t, with its own buffers and state. All pipelines share
+ * the DRM fd and the main loop.
+ */
+struct pipeline {
+	int index;
+	struct drm_dev_t *dev;
+
+	/* Filled by pipeline_probe() while DRM enumerates */
+	const char *v4l2_path;
+	int v4l2_fd;
+	uint32_t fourccs[32];
+	int fourcc_count;
+	pthread_t probe_thread;
+	uint64_t probe_ns;
+
+	struct buffer *buffers;
+	int buffer_count;
+	struct buffer *front_buffer, *back_buffer;
+
+	/* V4L allocates the buffers, DRM imports them */
+	int import;
+	/* Part of the zoom done by cropping the sensor, the plane does the rest */
+	unsigned int crop_zoom;
+
+	/* Explicit-fence mode state */
+	int use_fences;
+	int sw_timeline;
+	unsigned int sw_seqno;
+	struct buffer_ring v4l_queue;
+	struct buffer *release_buffer;
+	int release_fence;
+	int watched_fence;
+
+	enum present_mode present_mode;
+	struct present_stats present_stats[PRESENT_MODE_COUNT];
+	struct buffer_ring pending;
+
+	unsigned long captured;
+	unsigned long dropped[SHMSTATS_DROP_COUNT];
+	unsigned long commit_failures;
+	unsigned long vblank_misses;
+	/* At the last watchdog period, for the rates */
+	unsigned long reported[SHMSTATS_DROP_COUNT];
+	unsigned long reported_misses;
+
+	/* Gap tracking on the V4L2 sequence and the vblank counter */
+	int sequence_valid;
+	uint32_t last_sequence;
+	int starved;
+	int vblank_valid;
+	unsigned int last_frame;
+	uint64_t last_vblank_ns;
+	/* Measured between consecutive vblanks, 0 until then */
+	uint64_t vblank_ns;
+
+	struct hist latency[LAT_COUNT];
+
+	/*
+	 * Conversion mode, when no format is both captured and scanned
+	 * out: V4L captures into buffers[], which the CPU converts into
+	 * scanout[], the buffers DRM shows.
+	 */
+	int convert;
+	struct drm_buffer_t *capture_bufs;
+	struct buffer *scanout;
+	int scanout_count;
+	struct v4l2_pix_format pix;
+	struct hist convert_ns;
+	struct hist sync_ns;
+	/* One per scanout buffer, and the ones on the pool in capture order */
+	struct convert_job *jobs;
+	struct buffer_ring converting;
+
+	/* Time of the first flip event, 0 until then */
+	uint64_t first_flip_ns;
+
+	/* Written by the capture thread, if any */
+	uint64_t last_dequeue_ns;
+	struct capture_thread capture;
+};
+
+static struct pipeline pipelines[MAX_PIPELINES];
+static int pipeline_count;
+
+/* Flips of all pipelines, committed together once per refresh period */
+static struct drm_batch_t batch;
+
+/* Defaults for every pipeline */
+static int use_fences;
+static int use_import;
+static int adopt_mode;
+static enum present_mode present_mode = PRESENT_MAILBOX;
+
+/*
+ * Converts frames in stripes, NULL to convert on the display thread.
+ * Workers hand finished jobs back through converted_fd.
+ */
+static struct pool *pool;
+static int worker_count = -1;
+static pthread_mutex_t converted_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct convert_job *converted;
+static int converted_fd = -1;
+
+/* Taken first thing in main(), for the time to first frame */
+static uint64_t start_ns;
+
+static int use_threads;
+static int capture_cpu = -1, display_cpu = -1;
+static int sched_priority;
+
+/* Both go through the logger, the frame path never waits on stdio */
+#define error(fmt, arg...)			\
+do {						\
+	log_error("ERROR: " fmt, ## arg);	\
+} while (0);					\
 
 #define debug(fmt, arg...)		\
 do {					\
 	if (debug) {			\
-		printf(fmt, ## arg);	\
+		log_debug(fmt, ## arg);	\
 	}				\
 } while (0);				\
 
-static struct buffer *find_buffer_from_v4l_index(int index)
+/* error() only logs, setup failures that leave no usable fd exit */
+static void fatal_errno(const char *what)
 {
-	int i;
+	perror(what);
+	exit(EXIT_FAILURE);
+}
 
-	for (i = 0; i < BUFCOUNT; i++)
-		if (buffers[i].v4l_index == index)
-			return &buffers[i];
-	return NULL;
+static void ring_init(struct buffer_ring *ring, int size)
+{
+	ring->slots = calloc(size, sizeof(*ring->slots));
+	if (!ring->slots)
+		fatal("cannot allocate buffer ring");
+	ring->head = ring->count = 0;
+	ring->size = size;
 }
 
-static void page_flip_handler(int fd, unsigned int frame,
-			    unsigned int sec, unsigned int usec,
-			    void *data)
+static void ring_push(struct buffer_ring *ring, struct buffer *buf)
 {
-	struct drm_dev_t *dev = data;
-	struct buffer *buf = front_buffer;
+	ring->slots[(ring->head + ring->count) % ring->size] = buf;
+	ring->count++;
+}
 
-	if (back_buffer) {
-		/* Back-buffer is now Front-buffer. And former front-buffer
-		 * is now idle and can be queued to V4L.
-		 */
-		debug("Buffer rendered: fd=%d, index=%d\n",
-			back_buffer->dmabuf_fd, back_buffer->v4l_index);
-		front_buffer = back_buffer;
-		back_buffer = NULL;
-	
+static struct buffer *ring_pop(struct buffer_ring *ring)
+{
+	struct buffer *buf = ring->slots[ring->head];
+
+	ring->head = (ring->head + 1) % ring->size;
+	ring->count--;
+	return buf;
+}
+
+/* V4L buffer indexes match their position in buffers[] */
+static struct buffer *find_buffer_from_v4l_index(struct pipeline *pipe, int index)
+{
+	if (index < 0 || index >= pipe->buffer_count)
+		return NULL;
+	return &pipe->buffers[index];
+}
+
+/* Simulated time with the mock devices */
+static uint64_t monotonic_ns(void)
+{
+	return devops->now_ns();
+}
+
+/* The DRM buffer behind buf */
+static struct drm_buffer_t *buffer_drm(struct pipeline *pipe, struct buffer *buf)
+{
+	if (!pipe->convert)
+		return &pipe->dev->bufs[buf - pipe->buffers];
+	if (buf->v4l_index >= 0)
+		return &pipe->capture_bufs[buf - pipe->buffers];
+	return &pipe->dev->bufs[buf - pipe->scanout];
+}
+
+/*
+ * Fit buf to the current capture format, keeping its memory if it is
+ * large enough. Capture buffers only have to hold sizeimage bytes.
+ * Buffers DRM shows get a new framebuffer, and if V4L writes into
+ * them, the V4L pitch.
+ */
+static void buffer_resize(struct pipeline *pipe, struct buffer *buf)
+{
+	struct drm_dev_t *dev = pipe->dev;
+	struct v4l2_pix_format *pix = &pipe->pix;
+	struct drm_buffer_t *db = buffer_drm(pipe, buf);
+	const struct format *f = dev->format;
+	uint32_t pitch;
+	int reuse;
+
+	if (pipe->convert && buf->v4l_index >= 0) {
+		f = format_from_v4l2(pix->pixelformat);
+		if (db->size < pix->sizeimage)
+			drm_realloc_dumb(dev->drm_fd, db, f,
+					pix->bytesperline / f->cpp[0],
+					pix->height, 1, 1);
+		goto out;
+	}
+
+	if (pipe->convert) {
+		pitch = dev->fb_width * f->cpp[0];
+		reuse = db->pitch >= pitch &&
+			db->size >= db->pitch * format_lines(f, dev->fb_height);
+	} else {
+		pitch = pix->bytesperline;
+		reuse = db->pitch == pitch && db->size >= pix->sizeimage;
+	}
+	if (!reuse) {
+		drm_realloc_dumb(dev->drm_fd, db, f, pitch / f->cpp[0],
+				dev->fb_height, pipe->convert, 1);
+		if (!pipe->convert && db->pitch != pitch)
+			fatal("new DRM pitch doesn't match the V4L2 one");
+	}
+	drm_update_fb(dev->drm_fd, dev, db);
+	buf->fb_id = db->fb_id;
+
+out:
+	buf->dmabuf_fd = db->dmabuf_fd;
+	buf->start = db->buf;
+	buf->stale = 0;
+}
+
+/*
+ * V4L2 polls POLLERR while no buffer is queued, the capture thread then
+ * sleeps until the display queues one.
+ */
+static void capture_thread_wake(struct pipeline *pipe)
+{
+	struct capture_thread *ct = &pipe->capture;
+	uint64_t one = 1;
+
+	if (!use_threads)
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ct->starved, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&ct->starved, 0, __ATOMIC_RELAXED) &&
+	    write(ct->queued_fd, &one, sizeof(one)) < 0)
+		error("capture thread wakeup");
+}
+
+static void queue_buffer(struct pipeline *pipe, struct buffer *buf)
+{
+	struct drm_dev_t *dev = pipe->dev;
+
+	/* Released by DRM after a format change */
+	if (buf->stale)
+		buffer_resize(pipe, buf);
+
+	buf->owner = V4L_OWNED;
+	buf->capture_ns = buf->dequeue_ns = 0;
+	buf->commit_ns = buf->flip_ns = 0;
+
+	/* Converted frames are not V4L buffers, they just become free */
+	if (buf->v4l_index < 0) {
+		buf->owner = NO_OWNER;
+		return;
+	}
+
+	if (!pipe->use_fences) {
 		v4l2_queue_buffer(dev->v4l2_fd, buf->v4l_index,
 				buf->dmabuf_fd,
 				V4L2_BUF_TYPE_VIDEO_CAPTURE);
-		buf->owner = V4L_OWNED;
+		capture_thread_wake(pipe);
+		return;
 	}
+
+	/* Out-fences are not mainline: once the driver gave none, stop asking */
+	if (pipe->sw_timeline < 0) {
+		buf->fence_fd = v4l2_queue_buffer_fence(dev->v4l2_fd,
+				buf->v4l_index, buf->dmabuf_fd,
+				V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	} else {
+		v4l2_queue_buffer(dev->v4l2_fd, buf->v4l_index,
+				buf->dmabuf_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+		buf->fence_fd = -1;
+	}
+	capture_thread_wake(pipe);
+
+	/* No capture fences from the driver: emulate them with sw_sync,
+	 * signaling the timeline on each dequeue.
+	 */
+	if (buf->fence_fd < 0) {
+		if (pipe->sw_timeline < 0) {
+			pipe->sw_timeline = sw_sync_timeline_create();
+			if (pipe->sw_timeline < 0)
+				fatal("no capture fences available");
+			log_warn("V4L2: no out-fences, using sw_sync\n");
+		}
+		buf->fence_fd = sw_sync_fence_create(pipe->sw_timeline,
+				"capture", ++pipe->sw_seqno);
+	}
+
+	/* V4L fills buffers in queueing order */
+	ring_push(&pipe->v4l_queue, buf);
 }
 
-static void handle_new_buffer(int v4l2_fd, int drm_fd, struct drm_dev_t *dev)
+static int display_idle(struct pipeline *pipe)
 {
-	struct v4l2_buffer v4l_buf;
-	struct buffer *buf;
-	int dequeued;
+	return !pipe->back_buffer && !pipe->release_buffer;
+}
 
-	dequeued = v4l2_dequeue_buffer(v4l2_fd, &v4l_buf, V4L2_BUF_TYPE_VIDEO_CAPTURE);
-	if (!dequeued)
-		return;
+static int display_buffer(struct pipeline *pipe, struct buffer *buf,
+		int in_fence_fd)
+{
+	struct drm_dev_t *dev = pipe->dev;
+	int *out_fence_fd = pipe->use_fences ? &pipe->release_fence : NULL;
+	int ret;
 
-	buf = find_buffer_from_v4l_index(v4l_buf.index);
-	if (!buf) {
-		error("Buffer captured index=%d, not found!\n",
-			v4l_buf.index);
-		return;
+	if (pipe->present_mode == PRESENT_IMMEDIATE) {
+		ret = drm_render_async(dev->drm_fd, buf->fb_id, in_fence_fd,
+				out_fence_fd, dev);
+		if (ret == -EINVAL) {
+			log_warn("DRM: no async atomic flips, using mailbox\n");
+			pipe->present_mode = PRESENT_MAILBOX;
+		}
 	}
 
-	debug("Buffer captured: fd=%d, index=%d\n",
-		buf->dmabuf_fd, buf->v4l_index);
+	/* Async flips can't be batched, vblank-synced ones wait for
+	 * batch_schedule() to commit them shortly before the next vblank.
+	 */
+	if (pipe->present_mode != PRESENT_IMMEDIATE)
+		ret = drm_batch_add(&batch, buf->fb_id, in_fence_fd,
+				out_fence_fd, dev);
+
+	if (!ret) {
+		if (pipe->use_fences)
+			pipe->release_buffer = pipe->front_buffer;
+		pipe->back_buffer = buf;
+		buf->commit_ns = monotonic_ns();
+	} else {
+		pipe->commit_failures++;
+	}
+	return ret;
+}
+
+static void drop_buffer(struct pipeline *pipe, struct buffer *buf,
+		enum shmstats_drop reason)
+{
+	debug("Dropping captured frame: index=%d\n", buf->v4l_index);
+	pipe->present_stats[pipe->present_mode].dropped++;
+	pipe->dropped[reason]++;
+	queue_buffer(pipe, buf);
+}
+
+static void present_buffer(struct pipeline *pipe, struct buffer *buf)
+{
+	buf->owner = DRM_OWNED;
 
 	/* Page-flip will happen on the next vertical blank.
 	 * This is a non-blocking, schedule operation.
 	 */
-	if (!back_buffer) {
-		drm_render_atomic(drm_fd, buf->fb_id, dev);
-		back_buffer = buf; 
-		buf->owner = DRM_OWNED;
-	} else {
-		error("Display busy, dropping captured frame!\n");
+	if (display_idle(pipe)) {
+		if (display_buffer(pipe, buf, -1))
+			drop_buffer(pipe, buf, SHMSTATS_DROP_COMMIT_FAILED);
+		return;
+	}
 
-		/* Display busy, drop the frame and simply queue it back. */
-		v4l2_queue_buffer(dev->v4l2_fd, buf->v4l_index,
-			buf->dmabuf_fd,
-			V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	/* Display busy, the frame waits for the next flip */
+	if (pipe->present_mode != PRESENT_FIFO && pipe->pending.count)
+		drop_buffer(pipe, ring_pop(&pipe->pending),
+				SHMSTATS_DROP_REPLACED);
+	ring_push(&pipe->pending, buf);
+}
+
+/*
+ * Commit the next buffer V4L will fill, before capture completes.
+ * The display waits on its capture fence.
+ */
+static void fence_commit_next(struct pipeline *pipe)
+{
+	struct buffer *buf;
+
+	if (!display_idle(pipe) || !pipe->v4l_queue.count)
+		return;
+
+	buf = pipe->v4l_queue.slots[pipe->v4l_queue.head];
+	if (buf->owner != V4L_OWNED || buf->fence_fd < 0)
+		return;
+
+	if (display_buffer(pipe, buf, buf->fence_fd))
+		return;
+
+	debug("Buffer committed: fd=%d, index=%d\n",
+		buf->dmabuf_fd, buf->v4l_index);
+
+	/* The fence is closed on dequeue, the batched commit needs it */
+	buf->owner = SHARED_OWNED;
+}
+
+/* Called whenever the display may have become idle */
+static void present_pending(struct pipeline *pipe)
+{
+	struct buffer *buf;
+
+	while (display_idle(pipe) && pipe->pending.count) {
+		buf = ring_pop(&pipe->pending);
+
+		if (display_buffer(pipe, buf, -1))
+			drop_buffer(pipe, buf, SHMSTATS_DROP_COMMIT_FAILED);
 	}
+
+	if (pipe->use_fences)
+		fence_commit_next(pipe);
 }
 
-static void mainloop(int v4l2_fd, int drm_fd, struct drm_dev_t *dev)
+static void latency_record(struct pipeline *pipe, enum latency_span span,
+		uint64_t from, uint64_t to)
 {
-	drmEventContext ev;
-	int r;
+	if (from && to >= from)
+		hist_record(&pipe->latency[span], to - from);
+}
 
-	struct pollfd fds[] = {
-		{ .fd = STDIN_FILENO, .events = POLLIN },
-		{ .fd = v4l2_fd, .events = POLLIN },
-		{ .fd = drm_fd, .events = POLLIN },
-	};
+/*
+ * Called once the frame was both dequeued and flipped, which happens
+ * in either order when committing ahead in fence mode.
+ */
+static void frame_done(struct pipeline *pipe, struct buffer *buf)
+{
+	latency_record(pipe, LAT_CAPTURE_DEQUEUE, buf->capture_ns, buf->dequeue_ns);
+	latency_record(pipe, LAT_DEQUEUE_COMMIT, buf->dequeue_ns, buf->commit_ns);
+	latency_record(pipe, LAT_COMMIT_FLIP, buf->commit_ns, buf->flip_ns);
+	latency_record(pipe, LAT_CAPTURE_FLIP, buf->capture_ns, buf->flip_ns);
+}
 
-	memset(&ev, 0, sizeof(ev));
-	ev.version = 2;
-	ev.page_flip_handler = page_flip_handler;
+static void stats_print(void)
+{
+	struct pipeline *pipe;
+	int i, p;
 
-	while (1) {
-		/* Wait until there is something to do */
-		r = poll(fds, 3, 3000);
-		if (-1 == r) {
-			if (EINTR == errno)
+	for (p = 0; p < pipeline_count; p++) {
+		pipe = &pipelines[p];
+		printf("pipeline %d: %s -> connector %d\n", p,
+			v4l2_paths[p], pipe->dev->conn_id);
+
+		for (i = 0; i < LAT_COUNT; i++)
+			hist_print(&pipe->latency[i], "ms", 1000000);
+		if (pipe->convert)
+			hist_print(&pipe->convert_ns, "ms", 1000000);
+		if (pipe->convert)
+			hist_print(&pipe->sync_ns, "us", 1000);
+
+		for (i = 0; i < PRESENT_MODE_COUNT; i++) {
+			struct present_stats *st = &pipe->present_stats[i];
+
+			if (!st->presented && !st->dropped)
 				continue;
-			error("error in poll %d", errno);
-			return;
+			printf("%s: presented %lu, dropped %lu, latency avg %llu us, max %llu us\n",
+				present_mode_names[i], st->presented, st->dropped,
+				st->presented ? (unsigned long long)(st->latency_ns / st->presented / 1000) : 0,
+				(unsigned long long)(st->latency_max_ns / 1000));
 		}
 
-		if (0 == r) {
-			error("timeout in poll\n");
-			return;
-		}
+		printf("lost:");
+		for (i = 0; i < SHMSTATS_DROP_COUNT; i++)
+			printf("%s %s %lu", i ? "," : "", shmstats_drop_names[i],
+				pipe->dropped[i]);
+		printf("; vblanks missed %lu\n", pipe->vblank_misses);
+	}
 
-		if (fds[0].revents & POLLIN) {
-			printf("User requested exit\n");
-			return;
-		}
+	printf("atomic: %lu commits for %lu flips, %lu failed\n",
+		batch.commits, batch.updates, batch.failures);
+	if (pool)
+		pool_print(pool);
+	log_print();
+}
+
+static void hist_json(FILE *f, struct hist *h)
+{
+	fprintf(f, "\"%s\": { \"n\": %llu, \"p50_us\": %llu, \"p99_us\": %llu, "
+			"\"p99.9_us\": %llu, \"max_us\": %llu }",
+		h->name, (unsigned long long)h->count,
+		(unsigned long long)hist_percentile(h, 50.0) / 1000,
+		(unsigned long long)hist_percentile(h, 99.0) / 1000,
+		(unsigned long long)hist_percentile(h, 99.9) / 1000,
+		(unsigned long long)h->max / 1000);
+}
+
+/* What stats_print() shows, for the bench script to collect */
+static void stats_json(const char *path, uint64_t run_ns)
+{
+	struct pipeline *pipe;
+	struct rusage ru;
+	unsigned long presented, dropped;
+	FILE *f;
+	int i, p;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return;
+	}
+	getrusage(RUSAGE_SELF, &ru);
 
-		if (fds[1].revents & POLLIN) {
-			handle_new_buffer(v4l2_fd, drm_fd, dev);
+	fprintf(f, "{\n  \"seconds\": %.3f,\n", run_ns / 1e9);
+	fprintf(f, "  \"cpu_user_ms\": %llu,\n  \"cpu_system_ms\": %llu,\n",
+		(unsigned long long)ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000,
+		(unsigned long long)ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000);
+	fprintf(f, "  \"present_mode\": \"%s\",\n  \"buffers\": %d,\n",
+		present_mode_names[present_mode], buffer_count);
+	fprintf(f, "  \"workers\": %d,\n", pool ? pool_size(pool) : 0);
+	fprintf(f, "  \"pipelines\": [");
+
+	for (p = 0; p < pipeline_count; p++) {
+		pipe = &pipelines[p];
+		presented = dropped = 0;
+		for (i = 0; i < PRESENT_MODE_COUNT; i++) {
+			presented += pipe->present_stats[i].presented;
+			dropped += pipe->present_stats[i].dropped;
 		}
 
-		if (fds[2].revents & POLLIN) {
-			drmHandleEvent(drm_fd, &ev);
+		fprintf(f, "%s\n    {\n", p ? "," : "");
+		fprintf(f, "      \"device\": \"%s\",\n", v4l2_paths[p]);
+		fprintf(f, "      \"width\": %u,\n      \"height\": %u,\n",
+			pipe->pix.width, pipe->pix.height);
+		fprintf(f, "      \"capture_format\": \"%.4s\",\n",
+			(char *)&pipe->pix.pixelformat);
+		fprintf(f, "      \"display_format\": \"%s\",\n",
+			pipe->dev->format->name);
+		fprintf(f, "      \"convert\": %d,\n      \"import\": %d,\n",
+			pipe->convert, pipe->import);
+		fprintf(f, "      \"presented\": %lu,\n      \"dropped\": %lu,\n",
+			presented, dropped);
+		fprintf(f, "      \"fps\": %.2f,\n",
+			run_ns ? presented * 1e9 / run_ns : 0.0);
+		fprintf(f, "      \"lost\": {");
+		for (i = 0; i < SHMSTATS_DROP_COUNT; i++)
+			fprintf(f, "%s \"%s\": %lu", i ? "," : "",
+				shmstats_drop_names[i], pipe->dropped[i]);
+		fprintf(f, " },\n      \"vblank_misses\": %lu,\n",
+			pipe->vblank_misses);
+		fprintf(f, "      \"latency\": {");
+		for (i = 0; i < LAT_COUNT; i++) {
+			fprintf(f, "%s\n        ", i ? "," : "");
+			hist_json(f, &pipe->latency[i]);
 		}
+		if (pipe->convert) {
+			fprintf(f, ",\n        ");
+			hist_json(f, &pipe->convert_ns);
+		}
+		fprintf(f, "\n      }\n    }");
 	}
+
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
 }
 
-int main()
+/* Live stats for v4l-drm-stat, NULL without shared memory */
+static struct shmstats *shm_stats;
+
+_Static_assert(LAT_COUNT == SHMSTATS_LATENCIES, "latency spans");
+_Static_assert(CPU_OWNED + 1 == SHMSTATS_OWNERS, "buffer owners");
+
+static void shm_count_owners(struct shmstats_pipeline *sp,
+		struct buffer *buffers, int count)
 {
-	struct drm_dev_t *dev_head, *dev;
-	int v4l2_fd, drm_fd;
 	int i;
 
-	drm_fd = drm_open(dri_path, 1, 1);
-	dev_head = drm_init(drm_fd);
+	for (i = 0; i < count; i++)
+		sp->owners[buffers[i].owner]++;
+}
 
-	if (dev_head == NULL) {
-		error("available drm_dev not found\n");
-		return EXIT_FAILURE;
+/*
+ * Copy the counters to shm_stats, once per round of events. With full
+ * set, every watchdog period, also walk the histograms for percentiles
+ * and refresh what rarely changes.
+ */
+static void shm_publish(int full)
+{
+	struct shmstats_latency lat[MAX_PIPELINES][LAT_COUNT];
+	struct shmstats_pipeline *sp;
+	struct pipeline *pipe;
+	struct hist *h;
+	int i, p;
+
+	if (!shm_stats)
+		return;
+
+	for (p = 0; full && p < pipeline_count; p++) {
+		for (i = 0; i < LAT_COUNT; i++) {
+			h = &pipelines[p].latency[i];
+			lat[p][i].count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+			lat[p][i].p50_ns = hist_percentile(h, 50.0);
+			lat[p][i].p99_ns = hist_percentile(h, 99.0);
+			lat[p][i].max_ns = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+		}
 	}
 
-	dev = dev_head;
+	shmstats_begin(shm_stats);
+	shm_stats->update_ns = monotonic_ns();
+	shm_stats->commits = batch.commits;
+	shm_stats->flips = batch.updates;
 
-	/* This creates four dmabuf exported buffers,
-	 * and then renders index-0.
-	 */
-	drm_setup_fb(drm_fd, dev, 0, 1);
+	for (p = 0; p < pipeline_count; p++) {
+		pipe = &pipelines[p];
+		sp = &shm_stats->pipelines[p];
 
-	for (i = 0; i < BUFCOUNT; i++) {
-		buffers[i].dmabuf_fd = dev->bufs[i].dmabuf_fd;
-		buffers[i].fb_id = dev->bufs[i].fb_id;
+		sp->captured = pipe->captured;
+		for (sp->displayed = 0, i = 0; i < PRESENT_MODE_COUNT; i++)
+			sp->displayed += pipe->present_stats[i].presented;
+		for (i = 0; i < SHMSTATS_DROP_COUNT; i++)
+			sp->dropped[i] = pipe->dropped[i];
+		sp->commit_failures = pipe->commit_failures;
+		sp->vblank_misses = pipe->vblank_misses;
+
+		memset(sp->owners, 0, sizeof(sp->owners));
+		shm_count_owners(sp, pipe->buffers, pipe->buffer_count);
+		if (pipe->convert)
+			shm_count_owners(sp, pipe->scanout, pipe->scanout_count);
+		sp->pending = pipe->pending.count;
+
+		if (!full)
+			continue;
+		snprintf(sp->device, sizeof(sp->device), "%s", v4l2_paths[p]);
+		snprintf(sp->present_mode, sizeof(sp->present_mode), "%s",
+			present_mode_names[pipe->present_mode]);
+		sp->conn_id = pipe->dev->conn_id;
+		sp->crtc_id = pipe->dev->crtc_id;
+		sp->width = pipe->pix.width;
+		sp->height = pipe->pix.height;
+		memcpy(sp->latency, lat[p], sizeof(sp->latency));
 	}
+	shm_stats->pipeline_count = pipeline_count;
+	shmstats_end(shm_stats);
+}
 
-	/* drm_setup_fb() renders the first frame,
-	 * so it becomes the front buffer.
-	 */
-	buffers[0].owner = DRM_OWNED;
-	front_buffer = &buffers[0];
-	back_buffer = NULL;
+/*
+ * The flip that replaced release_buffer on screen is done,
+ * so it can be given back to V4L.
+ */
+static void fence_release(struct pipeline *pipe)
+{
+	struct buffer *buf = pipe->release_buffer;
 
-	/*
-	 * This is just a demo, so there's no modesetting.
-	 * The program assumes DRM will start on 640x480.
-	 * It's easily fixable, by adding some modesetting code
-	 * in the DRM side.
-	 */
-	v4l2_fd = v4l2_open(v4l2_path, O_RDWR | O_NONBLOCK);
-	v4l2_set_fmt(v4l2_fd, 640, 480, V4L2_BUF_TYPE_VIDEO_CAPTURE, V4L2_PIX_FMT_BGR32);
-	v4l2_init_dmabuf(v4l2_fd, BUFCOUNT, V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers);
+	close(pipe->release_fence);
+	pipe->release_fence = -1;
+	pipe->release_buffer = NULL;
+
+	/* Not dequeued yet, process_buffer() will requeue it */
+	if (buf->owner == SHARED_OWNED)
+		buf->owner = NO_OWNER;
+	else
+		queue_buffer(pipe, buf);
+
+	present_pending(pipe);
+}
+
+/* Returns 1 if the dequeued buffer was already committed ahead */
+static int fence_dequeued(struct pipeline *pipe, struct buffer *buf)
+{
+	if (!pipe->v4l_queue.count || ring_pop(&pipe->v4l_queue) != buf)
+		error("Buffer dequeued out of order, index=%d\n",
+			buf->v4l_index);
+
+	if (pipe->sw_timeline >= 0)
+		sw_sync_timeline_inc(pipe->sw_timeline, 1);
 
-	/* index-0 starts owned by DRM, queue the remaining to V4L */
-	for (i = 1; i < BUFCOUNT; ++i) {
-		v4l2_queue_buffer(v4l2_fd, i, buffers[i].dmabuf_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
-		buffers[i].owner = V4L_OWNED;
+	if (buf->fence_fd >= 0)
+		close(buf->fence_fd);
+	buf->fence_fd = -1;
+
+	switch (buf->owner) {
+	case SHARED_OWNED:
+		buf->owner = DRM_OWNED;
+		if (buf->flip_ns)
+			frame_done(pipe, buf);
+		return 1;
+	case NO_OWNER:
+		/* Already shown and released */
+		frame_done(pipe, buf);
+		queue_buffer(pipe, buf);
+		return 1;
+	default:
+		return 0;
 	}
-	v4l2_start(v4l2_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+}
 
-	dev->v4l2_fd = v4l2_fd;
-	dev->drm_fd = drm_fd;
+/*
+ * A batched commit sends one event per CRTC, all with the same
+ * user data, so the CRTC tells which pipeline flipped.
+ */
+static struct pipeline *find_pipeline_from_crtc(uint32_t crtc_id)
+{
+	int p;
+
+	for (p = 0; p < pipeline_count; p++)
+		if (pipelines[p].dev->crtc_id == crtc_id)
+			return &pipelines[p];
+	return NULL;
+}
+
+/* Refresh period of the mode, 0 if unknown */
+static uint64_t mode_period_ns(const drmModeModeInfo *mode)
+{
+	if (mode->clock && mode->htotal && mode->vtotal)
+		return (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+	if (mode->vrefresh)
+		return 1000000000 / mode->vrefresh;
+	return 0;
+}
+
+/*
+ * The vblank counter tells which vblank a flip took. A frame should be
+ * on screen at the first vblank after it was committed, or after its
+ * capture in fence mode, as waiting on a late camera isn't a miss.
+ * The period starts from the mode and follows consecutive flips.
+ */
+static void track_vblank(struct pipeline *pipe, struct buffer *buf,
+		unsigned int frame, uint64_t flip_ns)
+{
+	uint64_t ready = buf->commit_ns, since;
+	unsigned int target, missed = 0;
+
+	if (pipe->use_fences && buf->capture_ns > ready)
+		ready = buf->capture_ns;
+	if (!pipe->vblank_ns)
+		pipe->vblank_ns = mode_period_ns(&pipe->dev->mode);
+
+	if (pipe->vblank_valid && frame - pipe->last_frame == 1 &&
+	    flip_ns > pipe->last_vblank_ns) {
+		since = flip_ns - pipe->last_vblank_ns;
+		pipe->vblank_ns = pipe->vblank_ns ?
+			(pipe->vblank_ns * 7 + since) / 8 : since;
+	} else if (pipe->vblank_ns && ready &&
+		   pipe->present_mode != PRESENT_IMMEDIATE) {
+		if (pipe->vblank_valid && ready > pipe->last_vblank_ns) {
+			/* Event times are truncated to us, take the middle */
+			since = ready - pipe->last_vblank_ns;
+			since = since > 500 ? since - 500 : 1;
+			target = pipe->last_frame +
+				(since + pipe->vblank_ns - 1) / pipe->vblank_ns;
+			missed = frame - target;
+		} else if (flip_ns > ready) {
+			/* No earlier flip to count vblanks from */
+			missed = (flip_ns - ready) / pipe->vblank_ns;
+		}
+		if (missed && missed < 0x80000000u)
+			pipe->vblank_misses += missed;
+	}
+
+	pipe->vblank_valid = 1;
+	pipe->last_frame = frame;
+	pipe->last_vblank_ns = flip_ns;
+}
+
+static void page_flip_handler(int fd, unsigned int frame,
+			    unsigned int sec, unsigned int usec,
+			    unsigned int crtc_id, void *data)
+{
+	struct pipeline *pipe = find_pipeline_from_crtc(crtc_id);
+	struct buffer *buf, *shown;
+	struct present_stats *st;
+	uint64_t flip_ns = sec * 1000000000ull + usec * 1000ull;
+
+	if (!pipe) {
+		error("Flip of unknown crtc %u\n", crtc_id);
+		return;
+	}
+	buf = pipe->front_buffer;
+	st = &pipe->present_stats[pipe->present_mode];
+
+	if (pipe->back_buffer) {
+		/* Back-buffer is now Front-buffer. And former front-buffer
+		 * is now idle and can be queued to V4L.
+		 */
+		debug("Buffer rendered: fd=%d, index=%d\n",
+			pipe->back_buffer->dmabuf_fd, pipe->back_buffer->v4l_index);
+		shown = pipe->front_buffer = pipe->back_buffer;
+		pipe->back_buffer = NULL;
+
+		/* Buffers committed ahead may be dequeued after the flip */
+		st->presented++;
+		shown->flip_ns = flip_ns;
+		track_vblank(pipe, shown, frame, flip_ns);
+		if (!pipe->first_flip_ns) {
+			pipe->first_flip_ns = monotonic_ns();
+			log_info("pipeline %d: first frame on screen %llu ms after start\n",
+				pipe->index,
+				(unsigned long long)(pipe->first_flip_ns - start_ns) / 1000000);
+		}
+		if (shown->dequeue_ns)
+			frame_done(pipe, shown);
+		if (shown->dequeue_ns && flip_ns > shown->dequeue_ns) {
+			uint64_t latency = flip_ns - shown->dequeue_ns;
+
+			st->latency_ns += latency;
+			if (latency > st->latency_max_ns)
+				st->latency_max_ns = latency;
+		}
+
+		/* In fence mode the out-fence releases the former front */
+		if (!pipe->use_fences)
+			queue_buffer(pipe, buf);
+
+		present_pending(pipe);
+	}
+}
+
+/*
+ * The batched commit carrying the flip to back_buffer failed. A frame
+ * committed ahead is still queued to V4L, fence_commit_next() retries
+ * it; a captured frame is dropped.
+ */
+static void display_failed(struct pipeline *pipe)
+{
+	struct buffer *buf = pipe->back_buffer;
+
+	pipe->back_buffer = NULL;
+	pipe->release_buffer = NULL;
+	pipe->commit_failures++;
+	buf->commit_ns = 0;
+
+	if (buf->owner == SHARED_OWNED)
+		buf->owner = V4L_OWNED;
+	else
+		drop_buffer(pipe, buf, SHMSTATS_DROP_COMMIT_FAILED);
+}
 
-	mainloop(v4l2_fd, drm_fd, dev);
+/* Commit every flip staged so far as a single atomic commit */
+static void batch_flush(int drm_fd)
+{
+	int i;
+
+	if (drm_batch_commit(drm_fd, &batch))
+		for (i = 0; i < batch.count; i++)
+			display_failed(batch.devs[i]->priv);
+	drm_batch_reset(&batch);
+}
+
+/*
+ * When a flip of pipe has to be committed to make its next vblank:
+ * BATCH_MARGIN_NS before it, estimated from the last flip and the
+ * period. Right away if there is no flip to count from yet.
+ */
+static uint64_t batch_due_ns(struct pipeline *pipe, uint64_t now)
+{
+	uint64_t next;
+
+	if (!pipe->vblank_valid || pipe->vblank_ns <= BATCH_MARGIN_NS)
+		return now;
+	next = pipe->last_vblank_ns + pipe->vblank_ns;
+	if (next <= now)
+		next += ((now - next) / pipe->vblank_ns + 1) * pipe->vblank_ns;
+	return next - BATCH_MARGIN_NS;
+}
+
+/*
+ * Hold the staged flips until the first of their CRTCs is due, so the
+ * flips all pipelines make during one refresh period share a commit.
+ * batch_fd fires at that deadline, or the flips go now if it passed.
+ */
+static void batch_schedule(int drm_fd, int batch_fd)
+{
+	static uint64_t armed_ns;
+	struct itimerspec at = { 0 };
+	uint64_t now, due, deadline = UINT64_MAX;
+	int i;
+
+	if (!batch.count)
+		return;
+
+	now = monotonic_ns();
+	for (i = 0; i < batch.count; i++) {
+		due = batch_due_ns(batch.devs[i]->priv, now);
+		if (due < deadline)
+			deadline = due;
+	}
+	if (deadline <= now) {
+		batch_flush(drm_fd);
+		deadline = 0;
+	}
+	if (deadline == armed_ns)
+		return;
+
+	/* A zero it_value disarms the timer */
+	armed_ns = deadline;
+	at.it_value.tv_sec = deadline / 1000000000;
+	at.it_value.tv_nsec = deadline % 1000000000;
+	timerfd_settime(batch_fd, TFD_TIMER_ABSTIME, &at, NULL);
+}
+
+/*
+ * Dequeue one buffer and timestamp it. Only touches the capture side
+ * of struct buffer, so it can run on the capture thread.
+ * Returns v4l2_dequeue_buffer() result, so callers can drain the queue.
+ */
+static int capture_buffer(struct pipeline *pipe, struct buffer **captured)
+{
+	struct v4l2_buffer v4l_buf;
+	struct buffer *buf;
+	int dequeued;
+	uint64_t now;
+
+	*captured = NULL;
+	dequeued = v4l2_dequeue_buffer(pipe->dev->v4l2_fd, &v4l_buf,
+			V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	if (dequeued <= 0)
+		return dequeued;
+
+	buf = find_buffer_from_v4l_index(pipe, v4l_buf.index);
+	if (!buf) {
+		error("Buffer captured index=%d, not found!\n",
+			v4l_buf.index);
+		return dequeued;
+	}
+
+	now = monotonic_ns();
+	__atomic_store_n(&pipe->last_dequeue_ns, now, __ATOMIC_RELAXED);
+	buf->dequeue_ns = now;
+	buf->sequence = v4l_buf.sequence;
+	if ((v4l_buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		buf->capture_ns = v4l_buf.timestamp.tv_sec * 1000000000ull +
+			v4l_buf.timestamp.tv_usec * 1000ull;
+
+	*captured = buf;
+	return dequeued;
+}
+
+/* A frame being converted into a scanout buffer */
+struct convert_job {
+	struct pool_job job;
+	struct pipeline *pipe;
+	struct buffer *capture, *out;
+	struct image src, dst;
+	uint32_t height, stripe_height;
+	uint64_t start_ns, end_ns;
+	int done;
+	struct convert_job *next;
+};
+
+/* More stripes than workers, so a preempted worker gets robbed */
+#define STRIPES_PER_WORKER	4
+
+static void convert_stripe(struct pool_job *job, unsigned int stripe)
+{
+	struct convert_job *cj = (struct convert_job *)job;
+	uint32_t y0 = stripe * cj->stripe_height;
+	uint32_t y1 = y0 + cj->stripe_height;
+
+	convert_rows(&cj->src, &cj->dst, y0, y1 < cj->height ? y1 : cj->height);
+}
+
+/* On the worker which converted the last stripe */
+static void convert_job_done(struct pool_job *job)
+{
+	struct convert_job *cj = (struct convert_job *)job;
+	uint64_t one = 1;
+
+	cj->end_ns = monotonic_ns();
+	pthread_mutex_lock(&converted_lock);
+	cj->next = converted;
+	converted = cj;
+	pthread_mutex_unlock(&converted_lock);
+
+	if (write(converted_fd, &one, sizeof(one)) < 0)
+		error("cannot signal converted frame\n");
+}
+
+/* Give the capture buffer back to V4L and show the converted frame */
+static void convert_finish(struct convert_job *cj)
+{
+	struct pipeline *pipe = cj->pipe;
+	struct buffer *out = cj->out;
+
+	hist_record(&pipe->convert_ns, cj->end_ns - cj->start_ns);
+	dmabuf_end(cj->capture->dmabuf_fd, DMA_BUF_SYNC_READ, &pipe->sync_ns);
+	dmabuf_end(out->dmabuf_fd, DMA_BUF_SYNC_WRITE, &pipe->sync_ns);
+	out->capture_ns = cj->capture->capture_ns;
+	out->dequeue_ns = cj->capture->dequeue_ns;
+	queue_buffer(pipe, cj->capture);
+	present_buffer(pipe, out);
+}
+
+/*
+ * Convert the captured frame into a free scanout buffer, in stripes on
+ * the pool if there is one. The frame is dropped if every scanout
+ * buffer is on screen, waiting for it or being converted.
+ */
+static void convert_buffer(struct pipeline *pipe, struct buffer *buf)
+{
+	struct drm_dev_t *dev = pipe->dev;
+	struct convert_job *cj;
+	struct buffer *out = NULL;
+	unsigned int stripes;
+	int i;
+
+	for (i = 0; i < pipe->scanout_count && !out; i++)
+		if (pipe->scanout[i].owner == NO_OWNER)
+			out = &pipe->scanout[i];
+	if (!out) {
+		drop_buffer(pipe, buf, SHMSTATS_DROP_NO_SCANOUT);
+		return;
+	}
+
+	/* Scanout buffers match dev->bufs[] */
+	i = out - pipe->scanout;
+	cj = &pipe->jobs[i];
+	cj->capture = buf;
+	cj->out = out;
+	image_init(&cj->src, format_from_v4l2(pipe->pix.pixelformat),
+		pipe->pix.width, pipe->pix.height, buf->start,
+		pipe->pix.bytesperline);
+	image_init(&cj->dst, dev->format, dev->fb_width, dev->fb_height,
+		out->start, dev->bufs[i].pitch);
+	cj->height = cj->src.height < cj->dst.height ?
+		cj->src.height : cj->dst.height;
+
+	/* The mappings are cached: V4L wrote buf behind the CPU's back,
+	 * and DRM must not scan out of the CPU caches.
+	 */
+	buf->owner = out->owner = CPU_OWNED;
+	dmabuf_begin(buf->dmabuf_fd, DMA_BUF_SYNC_READ, &pipe->sync_ns);
+	dmabuf_begin(out->dmabuf_fd, DMA_BUF_SYNC_WRITE, &pipe->sync_ns);
+	cj->start_ns = monotonic_ns();
+
+	if (!pool) {
+		convert_rows(&cj->src, &cj->dst, 0, cj->height);
+		cj->end_ns = monotonic_ns();
+		convert_finish(cj);
+		return;
+	}
+
+	stripes = pool_size(pool) * STRIPES_PER_WORKER;
+	cj->stripe_height = (cj->height + stripes - 1) / stripes;
+	cj->job.stripes = (cj->height + cj->stripe_height - 1) / cj->stripe_height;
+	cj->done = 0;
+	ring_push(&pipe->converting, out);
+	pool_submit(pool, &cj->job);
+}
+
+/*
+ * Show the frames the workers are done with. A frame waits for the
+ * ones captured before it on the same pipeline, which may still have
+ * stripes in flight.
+ */
+static void handle_converted(void)
+{
+	struct convert_job *cj, *next;
+	struct pipeline *pipe;
+	struct buffer *out;
+	uint64_t count;
+	int p;
+
+	if (read(converted_fd, &count, sizeof(count)) < 0)
+		return;
+
+	pthread_mutex_lock(&converted_lock);
+	cj = converted;
+	converted = NULL;
+	pthread_mutex_unlock(&converted_lock);
+
+	for (; cj; cj = next) {
+		next = cj->next;
+		cj->done = 1;
+	}
+
+	for (p = 0; p < pipeline_count; p++) {
+		pipe = &pipelines[p];
+		while (pipe->converting.count) {
+			out = pipe->converting.slots[pipe->converting.head];
+			cj = &pipe->jobs[out - pipe->scanout];
+			if (!cj->done)
+				break;
+			ring_pop(&pipe->converting);
+			convert_finish(cj);
+		}
+	}
+}
+
+/* Wait for the frames of pipe still on the pool */
+static void convert_drain(struct pipeline *pipe)
+{
+	struct pollfd fds = { .fd = converted_fd, .events = POLLIN };
+
+	while (pipe->converting.count) {
+		poll(&fds, 1, -1);
+		handle_converted();
+	}
+}
+
+/*
+ * Frames missing from the V4L2 sequence were lost before DQBUF: by the
+ * sensor or driver while we kept buffers queued, for want of a buffer
+ * when the previous DQBUF took the last one.
+ */
+static void track_sequence(struct pipeline *pipe, struct buffer *buf)
+{
+	uint32_t lost = buf->sequence - pipe->last_sequence - 1;
+	int i, queued = 0;
+
+	/* Backwards when streaming restarted */
+	if (pipe->sequence_valid && lost && lost < 0x80000000u)
+		pipe->dropped[pipe->starved ? SHMSTATS_DROP_NO_BUFFER :
+				SHMSTATS_DROP_SENSOR] += lost;
+	pipe->sequence_valid = 1;
+	pipe->last_sequence = buf->sequence;
+
+	for (i = 0; i < pipe->buffer_count; i++)
+		if (&pipe->buffers[i] != buf &&
+		    (pipe->buffers[i].owner == V4L_OWNED ||
+		     pipe->buffers[i].owner == SHARED_OWNED))
+			queued++;
+	pipe->starved = !queued;
+}
+
+/* Display side of a dequeued buffer */
+static void process_buffer(struct pipeline *pipe, struct buffer *buf)
+{
+	debug("Buffer captured: fd=%d, index=%d\n",
+		buf->dmabuf_fd, buf->v4l_index);
+	pipe->captured++;
+	track_sequence(pipe, buf);
+
+	if (pipe->convert) {
+		convert_buffer(pipe, buf);
+		return;
+	}
+
+	if (pipe->use_fences && fence_dequeued(pipe, buf))
+		return;
+
+	present_buffer(pipe, buf);
+}
+
+static int handle_new_buffer(struct pipeline *pipe)
+{
+	struct buffer *buf;
+	int dequeued;
+
+	dequeued = capture_buffer(pipe, &buf);
+	if (buf)
+		process_buffer(pipe, buf);
+	return dequeued;
+}
+
+static void handle_captured(struct pipeline *pipe)
+{
+	struct buffer *buf;
+	uint64_t count;
+
+	if (read(pipe->capture.captured_fd, &count, sizeof(count)) < 0)
+		return;
+
+	while ((buf = spsc_pop(&pipe->capture.ring)))
+		process_buffer(pipe, buf);
+}
+
+static void set_thread_policy(pthread_t thread, int cpu, const char *name)
+{
+	struct sched_param param = { .sched_priority = sched_priority };
+	cpu_set_t cpus;
+	int ret;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		ret = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+		if (ret)
+			printf("%s thread: cannot run on CPU %d: %s\n",
+				name, cpu, strerror(ret));
+	}
+
+	if (sched_priority) {
+		ret = pthread_setschedparam(thread, SCHED_FIFO, &param);
+		if (ret)
+			printf("%s thread: cannot use SCHED_FIFO: %s\n",
+				name, strerror(ret));
+	}
+}
+
+static void *capture_thread_fn(void *arg)
+{
+	struct pipeline *pipe = arg;
+	struct capture_thread *ct = &pipe->capture;
+	struct pollfd fds[] = {
+		{ .fd = pipe->dev->v4l2_fd, .events = POLLIN },
+		{ .fd = ct->stop_fd, .events = POLLIN },
+		{ .fd = ct->queued_fd, .events = POLLIN },
+	};
+	struct buffer *buf;
+	uint64_t one = 1;
+	int pushed;
+
+	while (!(fds[1].revents & POLLIN)) {
+		if (poll(fds, 3, -1) < 0 && errno != EINTR)
+			break;
+
+		/* Queued again, V4L2 can be polled again */
+		if (fds[2].revents & POLLIN) {
+			if (read(ct->queued_fd, &one, sizeof(one)) < 0)
+				break;
+			fds[0].fd = pipe->dev->v4l2_fd;
+		}
+
+		/*
+		 * Nothing queued, the display and converters hold every
+		 * buffer. Stop polling V4L2 until capture_thread_wake(),
+		 * unless a buffer got queued before starved was seen.
+		 */
+		if ((fds[0].revents & (POLLERR | POLLHUP)) &&
+		    !(fds[0].revents & POLLIN)) {
+			__atomic_store_n(&ct->starved, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (poll(fds, 1, 0) >= 0 &&
+			    !(fds[0].revents & (POLLERR | POLLHUP)))
+				__atomic_store_n(&ct->starved, 0, __ATOMIC_RELAXED);
+			else
+				fds[0].fd = -1;
+		}
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		pushed = 0;
+		while (capture_buffer(pipe, &buf) > 0) {
+			/* The ring holds every buffer, a full one lost track */
+			if (buf && !spsc_push(&ct->ring, buf))
+				fatal("capture ring overflow");
+			if (buf)
+				pushed++;
+		}
+
+		/* One wakeup for the whole batch */
+		if (pushed && write(ct->captured_fd, &one, sizeof(one)) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static void capture_thread_init(struct pipeline *pipe)
+{
+	struct capture_thread *ct = &pipe->capture;
+
+	ct->captured_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ct->stop_fd = eventfd(0, EFD_CLOEXEC);
+	ct->queued_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ct->captured_fd < 0 || ct->stop_fd < 0 || ct->queued_fd < 0)
+		fatal_errno("eventfd");
+	if (spsc_init(&ct->ring, pipe->buffer_count))
+		fatal("cannot allocate capture ring");
+}
+
+static void capture_thread_start(struct pipeline *pipe)
+{
+	if (pthread_create(&pipe->capture.thread, NULL, capture_thread_fn, pipe))
+		fatal("cannot create capture thread");
+
+	set_thread_policy(pipe->capture.thread, capture_cpu, "capture");
+}
+
+/* Join the thread, capture_thread_start() starts it again */
+static void capture_thread_pause(struct pipeline *pipe)
+{
+	struct capture_thread *ct = &pipe->capture;
+	uint64_t one = 1;
+
+	if (write(ct->stop_fd, &one, sizeof(one)) < 0)
+		return;
+	pthread_join(ct->thread, NULL);
+	if (read(ct->stop_fd, &one, sizeof(one)) < 0)
+		error("cannot rearm the capture thread\n");
+}
+
+static void capture_thread_stop(struct pipeline *pipe)
+{
+	struct capture_thread *ct = &pipe->capture;
+	uint64_t one = 1;
+
+	if (write(ct->stop_fd, &one, sizeof(one)) < 0)
+		return;
+	pthread_join(ct->thread, NULL);
+	close(ct->captured_fd);
+	close(ct->stop_fd);
+	close(ct->queued_fd);
+	free(ct->ring.slots);
+}
+
+static void handle_source_change(struct pipeline *pipe);
+
+enum event_source {
+	EV_V4L2 = 0,
+	EV_CAPTURED,
+	EV_DRM,
+	EV_FENCE,
+	EV_TIMER,
+	EV_SIGNAL,
+	EV_CONVERTED,
+	EV_BATCH
+};
+
+/* epoll data: the event source and the pipeline it belongs to */
+#define EV_DATA(source, pipe_index)	(((uint64_t)(pipe_index) << 32) | (source))
+#define EV_SOURCE(data)			((uint32_t)(data))
+#define EV_PIPELINE(data)		(&pipelines[(data) >> 32])
+
+static int epoll_add(int epoll_fd, int fd, uint32_t events, uint64_t data)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = data };
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Frames lost since the last watchdog period, per second and stage */
+static void loss_report(struct pipeline *pipe)
+{
+	unsigned long lost, total = 0, misses;
+	char line[256];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < SHMSTATS_DROP_COUNT; i++) {
+		lost = pipe->dropped[i] - pipe->reported[i];
+		pipe->reported[i] = pipe->dropped[i];
+		total += lost;
+		len += snprintf(line + len, sizeof(line) - len, "%s %s %lu",
+			i ? "," : "", shmstats_drop_names[i],
+			lost / WATCHDOG_PERIOD_S);
+	}
+	misses = pipe->vblank_misses - pipe->reported_misses;
+	pipe->reported_misses = pipe->vblank_misses;
+
+	if (total || misses)
+		log_info("pipeline %d: lost%s; vblanks missed %lu, per second\n",
+			pipe->index, line, misses / WATCHDOG_PERIOD_S);
+}
+
+/* Returns 1 if the main loop should exit, once every pipeline stalled */
+static int watchdog(void)
+{
+	uint64_t now = monotonic_ns();
+	struct pipeline *pipe;
+	uint64_t last;
+	int p, stalled = 0;
+
+	for (p = 0; p < pipeline_count; p++) {
+		pipe = &pipelines[p];
+		last = __atomic_load_n(&pipe->last_dequeue_ns, __ATOMIC_RELAXED);
+
+		if (now > last && now - last > CAPTURE_TIMEOUT_NS) {
+			error("pipeline %d: no frame captured for %llu ms\n", p,
+				(unsigned long long)((now - last) / 1000000));
+			stalled++;
+		}
+
+		if (pipe->back_buffer && pipe->back_buffer->commit_ns &&
+		    now - pipe->back_buffer->commit_ns > FLIP_TIMEOUT_NS)
+			error("pipeline %d: flip pending for %llu ms, index=%d\n", p,
+				(unsigned long long)((now - pipe->back_buffer->commit_ns) / 1000000),
+				pipe->back_buffer->v4l_index);
+
+		loss_report(pipe);
+	}
+
+	return stalled == pipeline_count;
+}
+
+/*
+ * Zoom into the center of every pipeline's frames, applied by the
+ * plane along with the next flip. It can't zoom out of what the
+ * sensor was cropped to at startup.
+ */
+static void set_zoom(unsigned int percent)
+{
+	struct drm_dev_t *dev;
+	int p;
+
+	zoom = percent;
+	log_info("Zoom %u%%\n", zoom);
+	for (p = 0; p < pipeline_count; p++) {
+		dev = pipelines[p].dev;
+		drm_set_zoom(dev, zoom * 100 / pipelines[p].crop_zoom,
+				dev->fb_width / 2, dev->fb_height / 2);
+	}
+}
+
+/* Returns 1 if the main loop should exit */
+static int handle_signals(int signal_fd)
+{
+	struct signalfd_siginfo si;
+
+	while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGUSR1) {
+			stats_print();
+			continue;
+		}
+		if (si.ssi_signo == SIGUSR2) {
+			set_zoom(zoom >= ZOOM_MAX ? 100 : zoom * 2);
+			continue;
+		}
+		if (si.ssi_signo == SIGALRM) {
+			printf("Exiting after %u s\n", run_seconds);
+			return 1;
+		}
+		printf("Exiting on signal %u\n", si.ssi_signo);
+		return 1;
+	}
+	return 0;
+}
+
+/* Handled through signalfd, the default action would kill us */
+static void handled_signals(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGUSR1);
+	sigaddset(mask, SIGUSR2);
+	sigaddset(mask, SIGALRM);
+}
+
+/*
+ * V4L2 and DRM are edge-triggered: every wakeup drains all ready
+ * buffers and events, so a burst of frames costs a single wakeup.
+ */
+static void mainloop(int drm_fd)
+{
+	struct itimerspec period = {
+		.it_interval = { .tv_sec = WATCHDOG_PERIOD_S },
+		.it_value = { .tv_sec = WATCHDOG_PERIOD_S },
+	};
+	struct epoll_event events[8];
+	struct pipeline *pipe;
+	drmEventContext ev;
+	int epoll_fd, timer_fd, signal_fd, batch_fd;
+	uint64_t expirations;
+	sigset_t mask;
+	int i, p, r;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 3;
+	ev.page_flip_handler2 = page_flip_handler;
+
+	/* Blocked in every thread since main() started */
+	handled_signals(&mask);
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	/* Page-flip event timestamps are CLOCK_MONOTONIC too */
+	batch_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (signal_fd < 0 || timer_fd < 0 || batch_fd < 0 || epoll_fd < 0)
+		fatal_errno("mainloop setup");
+	timerfd_settime(timer_fd, 0, &period, NULL);
+
+	/* drmHandleEvent() would block on an empty queue */
+	fcntl(drm_fd, F_SETFL, fcntl(drm_fd, F_GETFL) | O_NONBLOCK);
+
+	if (epoll_add(epoll_fd, drm_fd, EPOLLIN | EPOLLET, EV_DATA(EV_DRM, 0)) ||
+	    epoll_add(epoll_fd, timer_fd, EPOLLIN, EV_DATA(EV_TIMER, 0)) ||
+	    epoll_add(epoll_fd, signal_fd, EPOLLIN, EV_DATA(EV_SIGNAL, 0)) ||
+	    epoll_add(epoll_fd, batch_fd, EPOLLIN, EV_DATA(EV_BATCH, 0)))
+		fatal_errno("epoll_ctl");
+	if (pool && epoll_add(epoll_fd, converted_fd, EPOLLIN,
+			EV_DATA(EV_CONVERTED, 0)))
+		fatal_errno("epoll_ctl");
+
+	for (p = 0; p < pipeline_count; p++) {
+		pipe = &pipelines[p];
+
+		/* Source changes are handled here, even with a capture thread */
+		if (use_threads) {
+			capture_thread_init(pipe);
+			r = epoll_add(epoll_fd, pipe->capture.captured_fd,
+					EPOLLIN, EV_DATA(EV_CAPTURED, p)) ||
+			    epoll_add(epoll_fd, pipe->dev->v4l2_fd,
+					EPOLLPRI | EPOLLET, EV_DATA(EV_V4L2, p));
+		} else {
+			r = epoll_add(epoll_fd, pipe->dev->v4l2_fd,
+					EPOLLIN | EPOLLPRI | EPOLLET,
+					EV_DATA(EV_V4L2, p));
+		}
+		if (r)
+			fatal_errno("epoll_ctl");
+
+		__atomic_store_n(&pipe->last_dequeue_ns, monotonic_ns(), __ATOMIC_RELAXED);
+		if (use_threads)
+			capture_thread_start(pipe);
+	}
+	set_thread_policy(pthread_self(), display_cpu, "display");
+	if (run_seconds)
+		alarm(run_seconds);
+
+	while (1) {
+		batch_schedule(drm_fd, batch_fd);
+		shm_publish(0);
+
+		/* Only watched while a flip holds the old front-buffer */
+		for (p = 0; p < pipeline_count; p++) {
+			pipe = &pipelines[p];
+			if (pipe->release_fence >= 0 && pipe->watched_fence < 0) {
+				if (epoll_add(epoll_fd, pipe->release_fence, EPOLLIN,
+						EV_DATA(EV_FENCE, p)))
+					error("epoll_ctl fence");
+				pipe->watched_fence = pipe->release_fence;
+			}
+		}
+
+		/* Wait until there is something to do */
+		r = epoll_wait(epoll_fd, events, 8, -1);
+		if (-1 == r) {
+			if (EINTR == errno)
+				continue;
+			error("error in epoll_wait %d", errno);
+			break;
+		}
+
+		for (i = 0; i < r; i++) {
+			pipe = EV_PIPELINE(events[i].data.u64);
+
+			switch (EV_SOURCE(events[i].data.u64)) {
+			case EV_SIGNAL:
+				if (handle_signals(signal_fd))
+					goto out;
+				break;
+			case EV_TIMER:
+				while (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+					;
+				if (watchdog())
+					goto out;
+				shm_publish(1);
+				break;
+			case EV_FENCE:
+				/* Closing the fence drops it from the epoll set */
+				pipe->watched_fence = -1;
+				fence_release(pipe);
+				break;
+			case EV_V4L2:
+				if (events[i].events & EPOLLPRI)
+					handle_source_change(pipe);
+				while (!use_threads && handle_new_buffer(pipe) > 0)
+					;
+				break;
+			case EV_CAPTURED:
+				handle_captured(pipe);
+				break;
+			case EV_CONVERTED:
+				handle_converted();
+				break;
+			case EV_BATCH:
+				while (read(batch_fd, &expirations, sizeof(expirations)) > 0)
+					;
+				batch_flush(drm_fd);
+				break;
+			case EV_DRM:
+				while (devops->drm_handle_event(drm_fd, &ev) == 0)
+					;
+				break;
+			}
+		}
+	}
+
+out:
+	for (p = 0; p < pipeline_count && use_threads; p++)
+		capture_thread_stop(&pipelines[p]);
+	close(epoll_fd);
+	close(timer_fd);
+	close(batch_fd);
+	close(signal_fd);
+}
+
+/* The first format of formats[] the camera captures and we can convert */
+static const struct format *convert_source(const uint32_t *fourccs, int count,
+		const struct format *dst)
+{
+	int i, j;
+
+	for (i = 0; i < format_count; i++)
+		for (j = 0; j < count; j++)
+			if (fourccs[j] == formats[i].v4l2_fourcc &&
+			    convert_supported(&formats[i], dst))
+				return &formats[i];
+	return NULL;
+}
+
+/*
+ * V4L2 writes into the DRM buffers with its own pitch, which must be
+ * the framebuffer one. drm_setup_fb() allocated at least the V4L2
+ * pitch, but the driver may have padded the lines further.
+ */
+static void pipeline_match_pitch(struct pipeline *pipe, int v4l2_fd)
+{
+	struct drm_dev_t *dev = pipe->dev;
+	struct v4l2_pix_format *pix = &pipe->pix;
+
+	if (pix->bytesperline != dev->pitch &&
+	    v4l2_set_pitch(v4l2_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, pix, dev->pitch)) {
+		printf("V4L2 pitch %d and DRM pitch %d differ, try import mode (-i)\n",
+			pix->bytesperline, dev->pitch);
+		fatal("no pitch both devices support");
+	}
+	if (dev->bufs[0].size < pix->sizeimage) {
+		printf("V4L2 image size %d exceeds the DRM buffer size %d\n",
+			pix->sizeimage, dev->bufs[0].size);
+		fatal("DRM buffers too small for the capture");
+	}
+}
+
+/*
+ * Capture the region of the sensor that is shown, at the smallest size
+ * covering it on the display unless -s says otherwise. When zooming,
+ * the sensor is cropped so only the shown region crosses the bus, and
+ * binned down to the capture size if the driver can scale.
+ */
+static void pipeline_set_capture(struct pipeline *pipe, int v4l2_fd,
+		const struct format *capture)
+{
+	const enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct drm_dev_t *dev = pipe->dev;
+	struct v4l2_pix_format *pix = &pipe->pix;
+	struct v4l2_rect bounds, crop, compose;
+	uint32_t width = capture_width, height = capture_height;
+	struct drm_rect shown;
+	int has_crop;
+
+	has_crop = !v4l2_get_selection(v4l2_fd, type, V4L2_SEL_TGT_CROP_BOUNDS,
+			&bounds);
+	if (has_crop) {
+		crop.width = (bounds.width * 100 / zoom) & ~1;
+		crop.height = (bounds.height * 100 / zoom) & ~1;
+		crop.left = bounds.left + (bounds.width - crop.width) / 2;
+		crop.top = bounds.top + (bounds.height - crop.height) / 2;
+	} else {
+		crop.width = dev->width;
+		crop.height = dev->height;
+	}
+
+	if (!width) {
+		drm_rect_fit(crop.width, crop.height, dev->width, dev->height,
+				1, &shown);
+		width = shown.w < crop.width ? shown.w : crop.width;
+		height = shown.h < crop.height ? shown.h : crop.height;
+		v4l2_frame_size(v4l2_fd, capture->v4l2_fourcc, &width, &height);
+	}
+
+	v4l2_set_fmt(v4l2_fd, width, height, type, capture->v4l2_fourcc, pix);
+	if (pix->pixelformat != capture->v4l2_fourcc)
+		fatal("V4L2 driver changed the pixel format");
+
+	if (!has_crop || zoom == 100)
+		return;
+
+	if (!v4l2_set_selection(v4l2_fd, type, V4L2_SEL_TGT_CROP, &crop)) {
+		/* Without a scaler the driver keeps compose at the crop size */
+		compose.left = compose.top = 0;
+		compose.width = pix->width;
+		compose.height = pix->height;
+		v4l2_set_selection(v4l2_fd, type, V4L2_SEL_TGT_COMPOSE, &compose);
+		pipe->crop_zoom = zoom;
+	}
+	/* The selection may have changed the format */
+	v4l2_get_fmt(v4l2_fd, type, pix);
+}
+
+/*
+ * Opening a camera and listing its formats can take a while, e.g. to
+ * power a USB one up, so it runs on a thread while DRM enumerates.
+ */
+static void *pipeline_probe(void *arg)
+{
+	struct pipeline *pipe = arg;
+	uint64_t start = monotonic_ns();
+
+	pipe->v4l2_fd = v4l2_open(pipe->v4l2_path, O_RDWR | O_NONBLOCK);
+	if (pipe->v4l2_fd >= 0)
+		pipe->fourcc_count = v4l2_enum_formats(pipe->v4l2_fd,
+				V4L2_BUF_TYPE_VIDEO_CAPTURE, pipe->fourccs,
+				sizeof(pipe->fourccs) / sizeof(pipe->fourccs[0]));
+	pipe->probe_ns = monotonic_ns() - start;
+	return NULL;
+}
+
+static void pipeline_probe_start(struct pipeline *pipe, const char *v4l2_path)
+{
+	pipe->v4l2_path = v4l2_path;
+	if (pthread_create(&pipe->probe_thread, NULL, pipeline_probe, pipe))
+		fatal("cannot create probe thread");
+}
+
+/* Prints how long a startup phase took and restarts the clock */
+static void startup_phase(int index, const char *phase, uint64_t *t)
+{
+	uint64_t now = monotonic_ns();
+
+	if (index < 0)
+		printf("startup: %s in %llu us\n", phase,
+			(unsigned long long)(now - *t) / 1000);
+	else
+		printf("startup: pipeline %d: %s in %llu us\n", index, phase,
+			(unsigned long long)(now - *t) / 1000);
+	*t = now;
+}
+
+/* Defaults of a pipeline showing on pipe->dev */
+static void pipeline_init(struct pipeline *pipe)
+{
+	int i;
+
+	pipe->use_fences = use_fences;
+	pipe->import = use_import;
+	pipe->crop_zoom = 100;
+	pipe->present_mode = present_mode;
+	pipe->sw_timeline = -1;
+	pipe->release_fence = -1;
+	pipe->watched_fence = -1;
+	for (i = 0; i < LAT_COUNT; i++)
+		pipe->latency[i].name = latency_names[i];
+	pipe->convert_ns.name = "convert";
+	pipe->sync_ns.name = "dmabuf sync";
+	pipe->dev->priv = pipe;
+}
+
+static void pipeline_setup(struct pipeline *pipe, int drm_fd,
+		struct drm_dev_t *dev_head)
+{
+	/* What the conversion produces, as V4L2 fourccs for drm_select_format() */
+	static const uint32_t rgb_fourccs[] = {
+		V4L2_PIX_FMT_XBGR32, V4L2_PIX_FMT_RGB565,
+	};
+	struct drm_dev_t *dev = pipe->dev;
+	const struct format *format, *capture;
+	struct v4l2_pix_format *pix = &pipe->pix;
+	uint32_t *fourccs = pipe->fourccs;
+	struct buffer *buffers, *scanout;
+	struct convert_job *jobs;
+	int dmabuf_fds[BUFCOUNT_MAX];
+	int v4l2_fd, count;
+	uint64_t t = monotonic_ns();
+	int i;
+
+	pipeline_init(pipe);
+
+	pthread_join(pipe->probe_thread, NULL);
+	printf("startup: pipeline %d: V4L2 probe in %llu us\n", pipe->index,
+		(unsigned long long)pipe->probe_ns / 1000);
+	startup_phase(pipe->index, "waited for the probe", &t);
+
+	v4l2_fd = pipe->v4l2_fd;
+	if (v4l2_fd < 0) {
+		fprintf(stderr, "cannot open V4L2 device %s\n", pipe->v4l2_path);
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Scan out what the camera captures natively, so nothing has to
+	 * convert frames on the way. This may move dev to an overlay plane.
+	 */
+	count = pipe->fourcc_count;
+	if (capture_format) {
+		for (i = 0; i < count; i++)
+			if (fourccs[i] == capture_format->v4l2_fourcc)
+				break;
+		if (i == count)
+			fatal("the camera doesn't capture the format asked for");
+		fourccs[0] = fourccs[i];
+		count = 1;
+	}
+	capture = format = drm_select_format(drm_fd, dev_head, dev, fourccs, count);
+
+	/* Nothing in common, capture YUV and convert it to RGB on the CPU */
+	if (!format) {
+		format = drm_select_format(drm_fd, dev_head, dev, rgb_fourccs,
+				sizeof(rgb_fourccs) / sizeof(rgb_fourccs[0]));
+		capture = format ? convert_source(fourccs, count, format) : NULL;
+		if (!capture)
+			fatal("no format both the camera and the display support");
+		printf("Converting %s to %s\n", capture->name, format->name);
+		pipe->convert = 1;
+	}
+
+	/*
+	 * This is just a demo, so there's no modesetting. Framebuffers
+	 * are the size the camera captures at, centered on the display
+	 * and scaled down if they don't fit.
+	 */
+	pipeline_set_capture(pipe, v4l2_fd, capture);
+	dev->fb_width = pix->width;
+	dev->fb_height = pix->height;
+	dev->fb_pitch = pipe->convert ? 0 : pix->bytesperline;
+	startup_phase(pipe->index, "format", &t);
+
+	/* The CPU waits for capture anyway */
+	if (pipe->use_fences && pipe->convert) {
+		printf("Fence mode disabled while converting\n");
+		pipe->use_fences = 0;
+	}
+	if (pipe->use_fences && !drm_has_fences(dev)) {
+		printf("DRM: no explicit fence support, fence mode disabled\n");
+		pipe->use_fences = 0;
+	}
+
+	buffers = calloc(buffer_count, sizeof(*buffers));
+	scanout = calloc(buffer_count, sizeof(*scanout));
+	jobs = calloc(buffer_count, sizeof(*jobs));
+	if (!buffers || !scanout || !jobs)
+		fatal("cannot allocate buffers");
+	ring_init(&pipe->v4l_queue, buffer_count);
+	ring_init(&pipe->pending, buffer_count);
+
+	/* Import mode: the camera allocates the buffers it captures into,
+	 * which DRM shows or the CPU converts from.
+	 */
+	if (pipe->import) {
+		count = v4l2_init_export(v4l2_fd, buffer_count,
+				V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers);
+		for (i = 0; i < count; i++) {
+			dmabuf_fds[i] = buffers[i].dmabuf_fd;
+			buffers[i].fence_fd = -1;
+		}
+		pipe->buffer_count = count;
+	}
+
+	/* This creates buffer_count dmabuf exported buffers, or imports
+	 * the camera ones. They are mapped for the CPU to convert into.
+	 */
+	if (pipe->import && !pipe->convert) {
+		drm_import_fb(drm_fd, dev, count, dmabuf_fds, pix->bytesperline);
+	} else {
+		drm_setup_fb(drm_fd, dev, buffer_count, pipe->convert, 1);
+		if (!pipe->convert)
+			pipeline_match_pitch(pipe, v4l2_fd);
+	}
+
+	for (i = 0; i < dev->buf_count; i++) {
+		scanout[i].dmabuf_fd = dev->bufs[i].dmabuf_fd;
+		scanout[i].fb_id = dev->bufs[i].fb_id;
+		scanout[i].start = dev->bufs[i].buf;
+		scanout[i].fence_fd = -1;
+		scanout[i].v4l_index = -1;
+	}
+
+	/* Capture into separate buffers the CPU reads back, V4L2 writes
+	 * bytesperline bytes per line.
+	 */
+	if (pipe->convert) {
+		if (pipe->import) {
+			for (i = 0; i < pipe->buffer_count; i++) {
+				buffers[i].start = dmabuf_mmap(buffers[i].dmabuf_fd,
+						buffers[i].length);
+				if (!buffers[i].start)
+					fatal("cannot map the V4L2 buffers");
+			}
+		} else {
+			pipe->capture_bufs = drm_alloc_dumb(drm_fd, buffer_count, capture,
+					pix->bytesperline / capture->cpp[0], pix->height, 1, 1);
+			if (pipe->capture_bufs[0].size < pix->sizeimage)
+				fatal("capture buffers smaller than the V4L2 image size");
+			for (i = 0; i < buffer_count; i++) {
+				buffers[i].dmabuf_fd = pipe->capture_bufs[i].dmabuf_fd;
+				buffers[i].start = pipe->capture_bufs[i].buf;
+				buffers[i].fence_fd = -1;
+			}
+		}
+		pipe->scanout = scanout;
+		pipe->scanout_count = buffer_count;
+
+		pipe->jobs = jobs;
+		for (i = 0; i < buffer_count; i++) {
+			pipe->jobs[i].job.run = convert_stripe;
+			pipe->jobs[i].job.done = convert_job_done;
+			pipe->jobs[i].pipe = pipe;
+		}
+		ring_init(&pipe->converting, buffer_count);
+	} else {
+		/* Imported buffers keep their V4L index */
+		for (i = 0; i < dev->buf_count; i++)
+			scanout[i].v4l_index = buffers[i].v4l_index;
+		memcpy(buffers, scanout, dev->buf_count * sizeof(*buffers));
+		free(scanout);
+		free(jobs);
+		scanout = buffers;
+	}
+
+	/* drm_show_fb() renders the first frame,
+	 * so it becomes the front buffer.
+	 */
+	scanout[0].owner = DRM_OWNED;
+	pipe->buffers = buffers;
+	pipe->front_buffer = &scanout[0];
+	pipe->back_buffer = NULL;
+
+	if (!pipe->import)
+		pipe->buffer_count = v4l2_init_dmabuf(v4l2_fd, buffer_count,
+				V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers);
+
+	dev->v4l2_fd = v4l2_fd;
+	dev->drm_fd = drm_fd;
+	startup_phase(pipe->index, "buffers", &t);
+
+	/* Queue to V4L whatever DRM doesn't own */
+	for (i = 0; i < pipe->buffer_count; ++i)
+		if (buffers[i].owner != DRM_OWNED)
+			queue_buffer(pipe, &buffers[i]);
+	v4l2_subscribe_source_change(v4l2_fd);
+	v4l2_start(v4l2_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	startup_phase(pipe->index, "stream on", &t);
+
+	/* The sensor starts up while the display may be modesetting */
+	drm_show_fb(drm_fd, dev);
+	startup_phase(pipe->index, "first buffer shown", &t);
+
+	if (pipe->use_fences)
+		fence_commit_next(pipe);
+}
+
+/*
+ * The format to capture in after a source change, from what the camera
+ * offers now: one the plane already showing the frames scans out, or
+ * one converting to the same RGB format. NULL if there is none.
+ */
+static const struct format *pipeline_negotiate(struct pipeline *pipe)
+{
+	struct drm_dev_t *dev = pipe->dev;
+	uint32_t *fourccs = pipe->fourccs;
+	int i, count;
+
+	count = v4l2_enum_formats(dev->v4l2_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			fourccs, sizeof(pipe->fourccs) / sizeof(pipe->fourccs[0]));
+	if (capture_format) {
+		for (i = 0; i < count; i++)
+			if (fourccs[i] == capture_format->v4l2_fourcc)
+				break;
+		if (i == count)
+			return NULL;
+		fourccs[0] = fourccs[i];
+		count = 1;
+	}
+	pipe->fourcc_count = count;
+
+	if (pipe->convert)
+		return convert_source(fourccs, count, dev->format);
+	/* No dev_head: the plane stays, only its format may change */
+	return drm_select_format(dev->drm_fd, NULL, dev, fourccs, count);
+}
+
+/*
+ * The source changed resolution or format: capture the new one without
+ * tearing the pipeline down. Buffers are resized while streaming is
+ * off, but the ones DRM shows or is about to, which are resized once
+ * released, so the display never goes blank. The new plane rectangles
+ * go with the first new frame. A change the pipeline can't follow is
+ * logged and the pipeline keeps its current format.
+ */
+static void pipeline_reconfigure(struct pipeline *pipe)
+{
+	const enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct drm_dev_t *dev = pipe->dev;
+	struct v4l2_pix_format *pix = &pipe->pix;
+	const struct format *capture;
+	int v4l2_fd = dev->v4l2_fd;
+	uint64_t start = monotonic_ns();
+	struct buffer *buf;
+	int i, stale = 0;
+
+	/* V4L2 can't free buffers DRM holds, nor fenced ones */
+	if (pipe->import || pipe->use_fences) {
+		log_warn("pipeline %d: source changed, cannot reconfigure in %s mode\n",
+			pipe->index, pipe->import ? "import" : "fence");
+		return;
+	}
+
+	/* Before anything stops, so an unusable source leaves it all as is */
+	capture = pipeline_negotiate(pipe);
+	if (!capture) {
+		log_warn("pipeline %d: source changed to no format %s can show\n",
+			pipe->index, pipe->convert ? "the conversion" : "the plane");
+		return;
+	}
+
+	if (use_threads)
+		capture_thread_pause(pipe);
+	if (pipe->convert)
+		convert_drain(pipe);
+
+	v4l2_stop(v4l2_fd, type);
+	v4l2_free_buffers(v4l2_fd, type);
+
+	/* Frames in the old format won't be shown */
+	while (use_threads && spsc_pop(&pipe->capture.ring))
+		;
+	while (pipe->pending.count) {
+		buf = ring_pop(&pipe->pending);
+		buf->owner = pipe->convert ? NO_OWNER : V4L_OWNED;
+	}
+
+	pipeline_set_capture(pipe, v4l2_fd, capture);
+	dev->fb_width = pix->width;
+	dev->fb_height = pix->height;
+	if (!pipe->convert)
+		dev->fb_pitch = dev->pitch = pix->bytesperline;
+
+	for (i = 0; i < pipe->buffer_count + pipe->scanout_count; i++) {
+		buf = i < pipe->buffer_count ? &pipe->buffers[i] :
+			&pipe->scanout[i - pipe->buffer_count];
+		if (buf == pipe->front_buffer || buf == pipe->back_buffer) {
+			buf->stale = 1;
+			stale++;
+			continue;
+		}
+		buffer_resize(pipe, buf);
+	}
+
+	pipe->buffer_count = v4l2_init_dmabuf(v4l2_fd, buffer_count, type,
+			pipe->buffers);
+	drm_set_zoom(dev, zoom * 100 / pipe->crop_zoom,
+			dev->fb_width / 2, dev->fb_height / 2);
+
+	for (i = 0; i < pipe->buffer_count; i++)
+		if (pipe->buffers[i].owner != DRM_OWNED)
+			queue_buffer(pipe, &pipe->buffers[i]);
+	/* The sequence restarts with streaming */
+	pipe->sequence_valid = 0;
+	v4l2_start(v4l2_fd, type);
+	if (use_threads)
+		capture_thread_start(pipe);
+
+	log_info("pipeline %d: reconfigured to %dx%d %s in %llu us, %d buffers left on screen\n",
+		pipe->index, pix->width, pix->height, capture->name,
+		(unsigned long long)(monotonic_ns() - start) / 1000, stale);
+}
+
+static void handle_source_change(struct pipeline *pipe)
+{
+	struct v4l2_event ev;
+	int changed = 0;
+
+	while (v4l2_dequeue_event(pipe->dev->v4l2_fd, &ev) > 0)
+		if (ev.type == V4L2_EVENT_SOURCE_CHANGE &&
+		    (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION))
+			changed = 1;
+
+	if (changed)
+		pipeline_reconfigure(pipe);
+}
+
+#define MOCK_PLANE_ID	31
+#define MOCK_CRTC_ID	41
+
+/*
+ * Run the display side against the mock devices, on simulated time
+ * and as fast as the CPU goes: the cost of the scheduling done by
+ * handle_new_buffer() and page_flip_handler(), and what it presents
+ * for the camera and display timings given.
+ */
+static int simulate(char *options)
+{
+	struct pipeline *pipe = &pipelines[0];
+	struct mock_config cfg;
+	struct drm_dev_t *dev;
+	struct buffer *buffers;
+	drmEventContext ev;
+	unsigned long frames = 0;
+	uint64_t start, elapsed;
+	int i, ready;
+
+	if (mock_parse(options, &cfg))
+		return -1;
+	mock_init(&cfg);
+	devops = &devops_mock;
+	start_ns = monotonic_ns();
+	debug = 0;
+
+	dev = drm_mock_dev(MOCK_PLANE_ID, MOCK_CRTC_ID, 1920, 1080, buffer_count);
+	dev->mode.vrefresh = 1000000000 / cfg.vblank_ns;
+	mock_add_display(MOCK_PLANE_ID, MOCK_CRTC_ID);
+	pipe->dev = dev;
+	pipeline_init(pipe);
+	pipe->use_fences = pipe->import = 0;
+	pipe->pix.width = dev->fb_width;
+	pipe->pix.height = dev->fb_height;
+	pipe->pix.pixelformat = dev->format->v4l2_fourcc;
+	v4l2_paths[0] = "mock";
+	pipeline_count = 1;
+
+	buffers = calloc(buffer_count, sizeof(*buffers));
+	if (!buffers)
+		fatal("cannot allocate buffers");
+	ring_init(&pipe->v4l_queue, buffer_count);
+	ring_init(&pipe->pending, buffer_count);
+	for (i = 0; i < buffer_count; i++) {
+		buffers[i].fb_id = dev->bufs[i].fb_id;
+		buffers[i].dmabuf_fd = -1;
+		buffers[i].fence_fd = -1;
+		buffers[i].v4l_index = i;
+	}
+	pipe->buffers = buffers;
+	pipe->buffer_count = buffer_count;
+
+	/* As if drm_show_fb() had shown the first one */
+	buffers[0].owner = DRM_OWNED;
+	pipe->front_buffer = &buffers[0];
+	for (i = 1; i < buffer_count; i++)
+		queue_buffer(pipe, &buffers[i]);
+	v4l2_start(dev->v4l2_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 3;
+	ev.page_flip_handler2 = page_flip_handler;
+
+	start = devops_real.now_ns();
+	while ((ready = mock_advance())) {
+		if (ready & MOCK_FLIP)
+			while (devops->drm_handle_event(dev->drm_fd, &ev) == 0)
+				;
+		if (ready & MOCK_CAPTURE)
+			while (handle_new_buffer(pipe) > 0)
+				;
+		/* A single pipeline, no other flip to wait for */
+		batch_flush(dev->drm_fd);
+	}
+	elapsed = devops_real.now_ns() - start;
+
+	for (i = 0; i < PRESENT_MODE_COUNT; i++)
+		frames += pipe->present_stats[i].presented +
+			pipe->present_stats[i].dropped;
+	mock_print();
+	stats_print();
+	printf("Simulated %lu frames in %llu ms, %.2f M frames/s\n", frames,
+		(unsigned long long)elapsed / 1000000,
+		elapsed ? frames * 1e3 / elapsed : 0.0);
+	if (json_path)
+		stats_json(json_path, monotonic_ns() - start_ns);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-v video]... [-D card] [-f] [-i] [-A] [-n buffers] [-s WxH]\n"
+			"\t[-F format] [-z zoom] [-p fifo|mailbox|immediate] [-t]\n"
+			"\t[-a capture_cpu,display_cpu] [-R priority] [-B count] [-K kernels]\n"
+			"\t[-C frames] [-w workers] [-d seconds] [-j file] [-q] [-M options]\n", name);
+	fprintf(stderr, "  -v  capture device, once per pipeline (default %s)\n",
+		v4l2_paths[0]);
+	fprintf(stderr, "  -D  display device (default %s)\n", dri_path);
+	fprintf(stderr, "  -f  explicit-fence mode: commit before capture completes\n");
+	fprintf(stderr, "  -i  import mode: capture into V4L2 buffers, imported into DRM\n");
+	fprintf(stderr, "  -A  adopt the mode the display already runs: no modeset, and the\n"
+			"      last frame stays up on exit\n");
+	fprintf(stderr, "  -n  number of buffers in the ring, %d to %d (default %d)\n",
+		BUFCOUNT_MIN, BUFCOUNT_MAX, BUFCOUNT);
+	fprintf(stderr, "  -s  capture size, the camera picks the closest it supports\n"
+			"      (default: the smallest covering the display)\n");
+	fprintf(stderr, "  -F  capture format, e.g. YUYV or NV12 (default: the best both\n"
+			"      devices support)\n");
+	fprintf(stderr, "  -z  digital zoom in percent, %d to %d, doubled by SIGUSR2.\n"
+			"      The sensor is cropped to it when the camera supports it\n",
+		100, ZOOM_MAX);
+	fprintf(stderr, "  -p  present mode for frames captured while the display is busy\n");
+	fprintf(stderr, "  -t  dequeue on a dedicated capture thread per pipeline\n");
+	fprintf(stderr, "  -a  pin the capture and display threads to CPUs\n");
+	fprintf(stderr, "  -R  run the threads with SCHED_FIFO at priority\n");
+	fprintf(stderr, "  -B  benchmark count test-only atomic commits and exit\n");
+	fprintf(stderr, "  -K  color conversion kernels: avx2, sse4, neon or scalar\n"
+			"      (default: the fastest the CPU supports)\n");
+	fprintf(stderr, "  -C  benchmark the conversion kernels on that many 1080p frames and exit\n");
+	fprintf(stderr, "  -w  conversion worker threads, 0 to convert on the display thread\n"
+			"      (default: one per CPU)\n");
+	fprintf(stderr, "  -d  exit after that many seconds\n");
+	fprintf(stderr, "  -j  write the stats to file as JSON on exit\n");
+	fprintf(stderr, "  -q  no per-frame messages\n");
+	fprintf(stderr, "  -M  simulate on mock devices and exit, options, times in us:\n"
+			"      frames=N,fps=N,frame_jitter=N,refresh=N,vblank_jitter=N,\n"
+			"      delay=N,deadline=N,seed=N,trace=file (\"c <ns>\" capture, \"v <ns>\" vblank)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct drm_dev_t *dev_head, *dev;
+	int drm_fd, video_count = 0;
+	int i, opt, bench_count = 0, convert_frames = 0;
+	const char *kernels = NULL;
+	char *mock_options = NULL;
+	sigset_t mask;
+	uint64_t t;
+
+	/*
+	 * Before any thread starts, threads inherit the mask and the kernel
+	 * may deliver a process signal to any thread not blocking it.
+	 */
+	handled_signals(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	start_ns = monotonic_ns();
+	log_start();
+
+	while ((opt = getopt(argc, argv, "v:D:fiAn:s:F:z:p:ta:R:B:K:C:w:d:j:qM:")) != -1) {
+		switch (opt) {
+		case 'v':
+			if (video_count == MAX_PIPELINES)
+				usage(argv[0]);
+			v4l2_paths[video_count++] = optarg;
+			break;
+		case 'D':
+			dri_path = optarg;
+			break;
+		case 'f':
+			use_fences = 1;
+			break;
+		case 'i':
+			use_import = 1;
+			break;
+		case 'A':
+			adopt_mode = 1;
+			break;
+		case 'n':
+			buffer_count = atoi(optarg);
+			if (buffer_count < BUFCOUNT_MIN || buffer_count > BUFCOUNT_MAX)
+				usage(argv[0]);
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &capture_width, &capture_height) != 2 ||
+			    capture_width <= 0 || capture_height <= 0)
+				usage(argv[0]);
+			break;
+		case 'F':
+			capture_format = format_from_name(optarg);
+			if (!capture_format)
+				usage(argv[0]);
+			break;
+		case 'z':
+			zoom = atoi(optarg);
+			if (zoom < 100 || zoom > ZOOM_MAX)
+				usage(argv[0]);
+			break;
+		case 'p':
+			for (i = 0; i < PRESENT_MODE_COUNT; i++)
+				if (!strcmp(optarg, present_mode_names[i]))
+					break;
+			if (i == PRESENT_MODE_COUNT)
+				usage(argv[0]);
+			present_mode = i;
+			break;
+		case 't':
+			use_threads = 1;
+			break;
+		case 'a':
+			if (sscanf(optarg, "%d,%d", &capture_cpu, &display_cpu) != 2)
+				usage(argv[0]);
+			break;
+		case 'R':
+			sched_priority = atoi(optarg);
+			break;
+		case 'B':
+			bench_count = atoi(optarg);
+			break;
+		case 'K':
+			kernels = optarg;
+			break;
+		case 'C':
+			convert_frames = atoi(optarg);
+			break;
+		case 'w':
+			worker_count = atoi(optarg);
+			if (worker_count < 0)
+				usage(argv[0]);
+			break;
+		case 'd':
+			run_seconds = atoi(optarg);
+			break;
+		case 'j':
+			json_path = optarg;
+			break;
+		case 'q':
+			debug = 0;
+			break;
+		case 'M':
+			mock_options = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!video_count)
+		video_count = 1;
+
+	kernels = convert_init(kernels);
+	if (!kernels) {
+		fprintf(stderr, "Conversion kernels not supported on this CPU\n");
+		usage(argv[0]);
+	}
+	printf("Conversion kernels: %s\n", kernels);
+
+	if (convert_frames > 0) {
+		convert_bench(1920, 1080, convert_frames);
+		return 0;
+	}
+
+	if (mock_options) {
+		if (simulate(mock_options))
+			usage(argv[0]);
+		return 0;
+	}
+
+	/* Cameras are probed while DRM enumerates */
+	for (i = 0; i < video_count && !bench_count; i++)
+		pipeline_probe_start(&pipelines[i], v4l2_paths[i]);
+
+	t = monotonic_ns();
+	drm_fd = drm_open(dri_path, 1, 1);
+	dev_head = drm_init(drm_fd, adopt_mode);
+	startup_phase(-1, "DRM init", &t);
+
+	if (dev_head == NULL) {
+		error("available drm_dev not found\n");
+		return EXIT_FAILURE;
+	}
+
+	if (bench_count > 0) {
+		dev = dev_head;
+		drm_setup_fb(drm_fd, dev, buffer_count, 0, 1);
+		drm_show_fb(drm_fd, dev);
+		drm_bench_commit(drm_fd, dev->bufs[1].fb_id, dev, bench_count);
+		drm_destroy(drm_fd, dev_head);
+		return 0;
+	}
+
+	/* Camera N is shown on the Nth connected display */
+	for (dev = dev_head; dev && pipeline_count < video_count; dev = dev->next) {
+		struct pipeline *pipe = &pipelines[pipeline_count];
+
+		pipe->index = pipeline_count;
+		pipe->dev = dev;
+		pipeline_setup(pipe, drm_fd, dev_head);
+		pipeline_count++;
+	}
+
+	if (pipeline_count < video_count)
+		printf("Only %d displays connected, ignoring %d capture devices\n",
+			pipeline_count, video_count - pipeline_count);
+	for (i = pipeline_count; i < video_count; i++) {
+		pthread_join(pipelines[i].probe_thread, NULL);
+		if (pipelines[i].v4l2_fd >= 0)
+			v4l2_close(pipelines[i].v4l2_fd);
+	}
+	printf("Present mode: %s\n", present_mode_names[present_mode]);
+	if (zoom != 100)
+		set_zoom(zoom);
+
+	for (i = 0; i < pipeline_count && !pipelines[i].convert; i++)
+		;
+	if (i < pipeline_count && worker_count) {
+		if (worker_count < 0)
+			worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+		converted_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (converted_fd < 0)
+			fatal_errno("eventfd");
+		pool = pool_create(worker_count);
+		if (!pool)
+			fatal("cannot start the conversion workers");
+		printf("Converting on %d workers\n", worker_count);
+	}
+
+	shm_stats = shmstats_create();
+	if (shm_stats)
+		shm_stats->start_ns = start_ns;
+	shm_publish(1);
+
+	t = monotonic_ns();
+	mainloop(drm_fd);
+	t = monotonic_ns() - t;
+	shmstats_destroy(shm_stats);
+	stats_print();
+	if (json_path)
+		stats_json(json_path, t);
+	if (pool) {
+		pool_destroy(pool);
+		close(converted_fd);
+	}
+	for (i = 0; i < pipeline_count; i++)
+		if (pipelines[i].capture_bufs)
+			drm_free_dumb(drm_fd, pipelines[i].capture_bufs, buffer_count);
 	drm_destroy(drm_fd, dev_head);
 	return 0;
 }
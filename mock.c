@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdrm/drm.h>
+
+#include "videodev2.h"
+#include "devops.h"
+#include "mock.h"
+
+#define MOCK_BUFFERS	32
+#define MOCK_DISPLAYS	8
+#define NEVER		UINT64_MAX
+
+static struct mock_config cfg;
+static uint64_t now;
+static uint32_t seed;
+
+/* Buffers in QBUF order, then captured ones in DQBUF order */
+static struct {
+	int streaming;
+	int queued[MOCK_BUFFERS];
+	unsigned int queued_head, queued_count;
+	struct {
+		int index;
+		uint32_t sequence;
+		uint64_t capture_ns;
+	} done[MOCK_BUFFERS];
+	unsigned int done_head, done_count;
+
+	uint64_t next_frame;
+	uint32_t sequence;
+	unsigned long captured, missed;
+} cam;
+
+static struct {
+	uint32_t plane_id, crtc_id;
+	/*
+	 * Vblanks left until the committed flip, or flipped and not told
+	 * yet.
+	 */
+	int pending, flipped;
+	uint64_t user_data, flip_ns;
+	uint32_t flip_sequence;
+} displays[MOCK_DISPLAYS];
+static int display_count;
+
+static uint64_t next_vblank;
+static uint32_t vblank_sequence;
+static unsigned long commits, busy, late;
+
+/* xorshift32, the same seed replays the same jitter */
+static int64_t jitter(uint64_t max)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return max ? (int64_t)(seed % (2 * max + 1)) - (int64_t)max : 0;
+}
+
+/* Periodic with jitter, never going back in time, the first at period */
+static uint64_t periodic(uint64_t prev, uint64_t index, uint64_t period,
+		uint64_t max_jitter)
+{
+	int64_t t = (int64_t)((index + 1) * period) + jitter(max_jitter);
+
+	return t > (int64_t)prev ? (uint64_t)t : prev;
+}
+
+static uint64_t frame_time(uint64_t prev, uint32_t index)
+{
+	if (cfg.capture_count)
+		return index < cfg.capture_count ? cfg.capture_trace[index] : NEVER;
+	if (index >= cfg.frames)
+		return NEVER;
+	return periodic(prev, index, cfg.frame_ns, cfg.frame_jitter_ns);
+}
+
+static uint64_t vblank_time(uint64_t prev, uint32_t index)
+{
+	if (cfg.vblank_count)
+		return index < cfg.vblank_count ? cfg.vblank_trace[index] : NEVER;
+	return periodic(prev, index, cfg.vblank_ns, cfg.vblank_jitter_ns);
+}
+
+static int mock_v4l2_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct v4l2_buffer *buf = arg;
+	unsigned int i;
+
+	switch (request) {
+	case VIDIOC_QBUF:
+		if (cam.queued_count == MOCK_BUFFERS)
+			break;
+		i = (cam.queued_head + cam.queued_count++) % MOCK_BUFFERS;
+		cam.queued[i] = buf->index;
+		return 0;
+	case VIDIOC_DQBUF:
+		if (!cam.done_count ||
+		    cam.done[cam.done_head].capture_ns + cfg.dequeue_delay_ns > now) {
+			errno = EAGAIN;
+			return -1;
+		}
+		i = cam.done_head;
+		cam.done_head = (cam.done_head + 1) % MOCK_BUFFERS;
+		cam.done_count--;
+		buf->index = cam.done[i].index;
+		buf->sequence = cam.done[i].sequence;
+		buf->flags = V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		buf->timestamp.tv_sec = cam.done[i].capture_ns / 1000000000;
+		buf->timestamp.tv_usec = cam.done[i].capture_ns % 1000000000 / 1000;
+		return 0;
+	case VIDIOC_STREAMON:
+		cam.streaming = 1;
+		return 0;
+	case VIDIOC_STREAMOFF:
+		cam.streaming = 0;
+		cam.queued_count = cam.done_count = 0;
+		return 0;
+	case VIDIOC_DQEVENT:
+		errno = ENOENT;
+		return -1;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static int find_display(uint32_t plane_id)
+{
+	int i;
+
+	for (i = 0; i < display_count; i++)
+		if (displays[i].plane_id == plane_id)
+			return i;
+	return -1;
+}
+
+/* One flip per plane in the request, each CRTC sends its own event */
+static int mock_drm_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct drm_mode_atomic *atomic = arg;
+	const uint32_t *objs;
+	uint32_t i;
+	int d;
+
+	if (request != DRM_IOCTL_MODE_ATOMIC) {
+		errno = ENOTTY;
+		return -1;
+	}
+	if (atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return 0;
+
+	objs = (const uint32_t *)(uintptr_t)atomic->objs_ptr;
+	for (i = 0; i < atomic->count_objs; i++) {
+		d = find_display(objs[i]);
+		if (d >= 0 && (displays[d].pending || displays[d].flipped)) {
+			busy++;
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	commits++;
+	if (!(atomic->flags & DRM_MODE_PAGE_FLIP_EVENT))
+		return 0;
+	for (i = 0; i < atomic->count_objs; i++) {
+		d = find_display(objs[i]);
+		if (d < 0)
+			continue;
+		displays[d].user_data = atomic->user_data;
+		if (atomic->flags & DRM_MODE_PAGE_FLIP_ASYNC) {
+			displays[d].flipped = 1;
+			displays[d].flip_ns = now;
+			displays[d].flip_sequence = vblank_sequence;
+		} else if (next_vblank - now < cfg.deadline_ns) {
+			displays[d].pending = 2;
+			late++;
+		} else {
+			displays[d].pending = 1;
+		}
+	}
+	return 0;
+}
+
+/* Like drmHandleEvent(), but -1 once there is nothing to tell */
+static int mock_drm_handle_event(int fd, drmEventContext *ev)
+{
+	int i, handled = 0;
+
+	for (i = 0; i < display_count; i++) {
+		if (!displays[i].flipped)
+			continue;
+		displays[i].flipped = 0;
+		handled++;
+		ev->page_flip_handler2(fd, displays[i].flip_sequence,
+				displays[i].flip_ns / 1000000000,
+				displays[i].flip_ns % 1000000000 / 1000,
+				displays[i].crtc_id,
+				(void *)(uintptr_t)displays[i].user_data);
+	}
+	if (handled)
+		return 0;
+	errno = EAGAIN;
+	return -1;
+}
+
+static uint64_t mock_now_ns(void)
+{
+	return now;
+}
+
+const struct devops devops_mock = {
+	.name			= "mock",
+	.v4l2_ioctl		= mock_v4l2_ioctl,
+	.drm_ioctl		= mock_drm_ioctl,
+	.drm_handle_event	= mock_drm_handle_event,
+	.now_ns			= mock_now_ns,
+};
+
+static void capture(void)
+{
+	unsigned int i;
+
+	if (!cam.queued_count) {
+		cam.missed++;
+	} else {
+		i = (cam.done_head + cam.done_count++) % MOCK_BUFFERS;
+		cam.done[i].index = cam.queued[cam.queued_head];
+		cam.done[i].sequence = cam.sequence;
+		cam.done[i].capture_ns = cam.next_frame;
+		cam.queued_head = (cam.queued_head + 1) % MOCK_BUFFERS;
+		cam.queued_count--;
+		cam.captured++;
+	}
+	cam.sequence++;
+	cam.next_frame = frame_time(cam.next_frame, cam.sequence);
+}
+
+static void vblank(void)
+{
+	int i;
+
+	for (i = 0; i < display_count; i++) {
+		if (!displays[i].pending || --displays[i].pending)
+			continue;
+		displays[i].flipped = 1;
+		displays[i].flip_ns = next_vblank;
+		displays[i].flip_sequence = vblank_sequence;
+	}
+	vblank_sequence++;
+	next_vblank = vblank_time(next_vblank, vblank_sequence);
+}
+
+/*
+ * Move the clock to the next capture, dequeue or vblank that makes
+ * something ready. Returns MOCK_CAPTURE and/or MOCK_FLIP, or 0 once
+ * no frame is left to capture nor flip to complete.
+ */
+int mock_advance(void)
+{
+	uint64_t t, dequeue;
+	int i, ready, pending;
+
+	do {
+		pending = 0;
+		for (i = 0; i < display_count; i++)
+			pending |= displays[i].pending;
+
+		t = cam.streaming ? cam.next_frame : NEVER;
+		if (cam.done_count) {
+			dequeue = cam.done[cam.done_head].capture_ns +
+				cfg.dequeue_delay_ns;
+			if (dequeue < t)
+				t = dequeue;
+		}
+		if (pending && next_vblank < t)
+			t = next_vblank;
+		if (t == NEVER)
+			return 0;
+		if (t > now)
+			now = t;
+
+		while (cam.streaming && cam.next_frame <= now)
+			capture();
+		while (next_vblank <= now)
+			vblank();
+
+		ready = 0;
+		if (cam.done_count &&
+		    cam.done[cam.done_head].capture_ns + cfg.dequeue_delay_ns <= now)
+			ready |= MOCK_CAPTURE;
+		for (i = 0; i < display_count; i++)
+			if (displays[i].flipped)
+				ready |= MOCK_FLIP;
+	} while (!ready);
+
+	return ready;
+}
+
+void mock_add_display(uint32_t plane_id, uint32_t crtc_id)
+{
+	if (display_count == MOCK_DISPLAYS)
+		return;
+	displays[display_count].plane_id = plane_id;
+	displays[display_count].crtc_id = crtc_id;
+	display_count++;
+}
+
+void mock_init(const struct mock_config *config)
+{
+	cfg = *config;
+	seed = cfg.seed ? cfg.seed : 1;
+	now = 0;
+	memset(&cam, 0, sizeof(cam));
+	display_count = 0;
+	vblank_sequence = 0;
+	commits = busy = late = 0;
+
+	cam.next_frame = frame_time(0, 0);
+	next_vblank = vblank_time(0, 0);
+}
+
+void mock_print(void)
+{
+	printf("mock: %llu ms simulated, %lu frames captured, %lu missed "
+		"without a queued buffer, %u vblanks, %lu commits, %lu busy, "
+		"%lu past the deadline\n",
+		(unsigned long long)now / 1000000, cam.captured, cam.missed,
+		vblank_sequence, commits, busy, late);
+}
+
+static int load_trace(const char *path, struct mock_config *cfg)
+{
+	unsigned long *count;
+	uint64_t **trace;
+	unsigned long long ns;
+	char kind, line[128];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %c %llu", &kind, &ns) != 2)
+			continue;
+		if (kind == 'c') {
+			trace = &cfg->capture_trace;
+			count = &cfg->capture_count;
+		} else if (kind == 'v') {
+			trace = &cfg->vblank_trace;
+			count = &cfg->vblank_count;
+		} else {
+			continue;
+		}
+		/* Grows by powers of two */
+		if (!(*count & (*count - 1))) {
+			*trace = realloc(*trace, (*count ? *count * 2 : 1) *
+					sizeof(**trace));
+			if (!*trace)
+				return -1;
+		}
+		(*trace)[(*count)++] = ns;
+	}
+	fclose(f);
+	printf("mock: %lu captures and %lu vblanks from %s\n",
+		cfg->capture_count, cfg->vblank_count, path);
+	return 0;
+}
+
+/*
+ * Comma separated suboptions, times in us:
+ * frames=N,fps=N,frame_jitter=N,refresh=N,vblank_jitter=N,delay=N,
+ * seed=N,trace=file
+ */
+int mock_parse(char *options, struct mock_config *cfg)
+{
+	enum { FRAMES, FPS, FRAME_JITTER, REFRESH, VBLANK_JITTER, DELAY,
+		DEADLINE, SEED, TRACE };
+	char *const tokens[] = {
+		[FRAMES]	= "frames",
+		[FPS]		= "fps",
+		[FRAME_JITTER]	= "frame_jitter",
+		[REFRESH]	= "refresh",
+		[VBLANK_JITTER]	= "vblank_jitter",
+		[DELAY]		= "delay",
+		[DEADLINE]	= "deadline",
+		[SEED]		= "seed",
+		[TRACE]		= "trace",
+		NULL
+	};
+	char *value;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->frames = 1000000;
+	cfg->frame_ns = 1000000000 / 30;
+	cfg->vblank_ns = 1000000000 / 60;
+	cfg->seed = 1;
+
+	while (*options) {
+		switch (getsubopt(&options, tokens, &value)) {
+		case FRAMES:
+			cfg->frames = value ? strtoul(value, NULL, 0) : 0;
+			break;
+		case FPS:
+			if (!value || !atoi(value))
+				return -1;
+			cfg->frame_ns = 1000000000 / atoi(value);
+			break;
+		case FRAME_JITTER:
+			cfg->frame_jitter_ns = value ? atoll(value) * 1000 : 0;
+			break;
+		case REFRESH:
+			if (!value || !atoi(value))
+				return -1;
+			cfg->vblank_ns = 1000000000 / atoi(value);
+			break;
+		case VBLANK_JITTER:
+			cfg->vblank_jitter_ns = value ? atoll(value) * 1000 : 0;
+			break;
+		case DELAY:
+			cfg->dequeue_delay_ns = value ? atoll(value) * 1000 : 0;
+			break;
+		case DEADLINE:
+			cfg->deadline_ns = value ? atoll(value) * 1000 : 0;
+			break;
+		case SEED:
+			cfg->seed = value ? strtoul(value, NULL, 0) : 0;
+			break;
+		case TRACE:
+			if (!value || load_trace(value, cfg))
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
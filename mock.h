@@ -0,0 +1,39 @@
+#include <stdint.h>
+
+/*
+ * In-process camera and display for devops_mock, on a simulated clock
+ * that only moves when mock_advance() is called. The camera captures
+ * a frame every frame_ns into the oldest queued buffer, or misses it
+ * if none is queued. The display flips at the first vblank after the
+ * commit, or the one after if the commit came within deadline_ns of
+ * it, vblanks coming every vblank_ns. Both get uniform jitter of
+ * up to the given amount, or follow a recorded trace.
+ */
+struct mock_config {
+	unsigned long frames;
+	uint64_t frame_ns, frame_jitter_ns;
+	uint64_t vblank_ns, vblank_jitter_ns;
+	/* From the end of capture until DQBUF returns the buffer */
+	uint64_t dequeue_delay_ns;
+	/* Commits closer than that to a vblank only flip at the next one */
+	uint64_t deadline_ns;
+	uint32_t seed;
+
+	/*
+	 * Replayed instead of the periodic timings when not empty.
+	 * Trace files have one event per line, "c <ns>" for the end of
+	 * a capture and "v <ns>" for a vblank, in time order.
+	 */
+	uint64_t *capture_trace, *vblank_trace;
+	unsigned long capture_count, vblank_count;
+};
+
+/* What mock_advance() made ready */
+#define MOCK_CAPTURE	(1 << 0)
+#define MOCK_FLIP	(1 << 1)
+
+int mock_parse(char *options, struct mock_config *cfg);
+void mock_init(const struct mock_config *cfg);
+void mock_add_display(uint32_t plane_id, uint32_t crtc_id);
+int mock_advance(void);
+void mock_print(void);
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define POOL_QUEUE_SIZE 1024
+
+struct pool_task {
+	struct pool_job *job;
+	unsigned int stripe;
+};
+
+/*
+ * The owner takes the oldest stripes first, so frames complete in
+ * order, thieves take the newest.
+ */
+struct pool_queue {
+	pthread_mutex_t lock;
+	struct pool_task tasks[POOL_QUEUE_SIZE];
+	unsigned int head, count;
+} __attribute__((aligned(64)));
+
+struct pool_worker {
+	struct pool *pool;
+	int index;
+	pthread_t thread;
+};
+
+struct pool {
+	int count;
+	struct pool_queue *queues;
+	struct pool_worker *workers;
+
+	/* Workers sleep while no task is queued */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int queued;
+	int stop;
+
+	unsigned long stripes, steals;
+};
+
+static int queue_pop(struct pool_queue *q, int steal, struct pool_task *task)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count) {
+		q->count--;
+		if (steal) {
+			*task = q->tasks[(q->head + q->count) % POOL_QUEUE_SIZE];
+		} else {
+			*task = q->tasks[q->head];
+			q->head = (q->head + 1) % POOL_QUEUE_SIZE;
+		}
+		ret = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+static int queue_push(struct pool_queue *q, struct pool_task *task)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count < POOL_QUEUE_SIZE) {
+		q->tasks[(q->head + q->count) % POOL_QUEUE_SIZE] = *task;
+		q->count++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+static void run_task(struct pool_task *task)
+{
+	struct pool_job *job = task->job;
+
+	job->run(job, task->stripe);
+	/* The job may be reused as soon as done() runs */
+	if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		job->done(job);
+}
+
+static int pool_take(struct pool *pool, int index, struct pool_task *task)
+{
+	int i;
+
+	if (queue_pop(&pool->queues[index], 0, task))
+		goto found;
+
+	for (i = 1; i < pool->count; i++) {
+		if (queue_pop(&pool->queues[(index + i) % pool->count], 1, task)) {
+			__atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+			goto found;
+		}
+	}
+	return 0;
+
+found:
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool_worker *w = arg;
+	struct pool *pool = w->pool;
+	struct pool_task task;
+	int stop;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) <= 0 &&
+		       !pool->stop)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		stop = pool->stop;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (pool_take(pool, w->index, &task))
+			run_task(&task);
+		else if (stop)
+			break;
+	}
+	return NULL;
+}
+
+struct pool *pool_create(int count)
+{
+	struct pool *pool;
+	char name[24];
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->count = count;
+	pool->queues = aligned_alloc(64, count * sizeof(*pool->queues));
+	pool->workers = calloc(count, sizeof(*pool->workers));
+	if (!pool->queues || !pool->workers)
+		goto err;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	for (i = 0; i < count; i++) {
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+		pool->queues[i].head = pool->queues[i].count = 0;
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, pool_worker,
+				&pool->workers[i])) {
+			pool->count = i;
+			pool_destroy(pool);
+			return NULL;
+		}
+		snprintf(name, sizeof(name), "worker%d", i);
+		pthread_setname_np(pool->workers[i].thread, name);
+	}
+	return pool;
+
+err:
+	free(pool->queues);
+	free(pool->workers);
+	free(pool);
+	return NULL;
+}
+
+int pool_size(struct pool *pool)
+{
+	return pool->count;
+}
+
+/*
+ * Worker N gets the Nth contiguous range of stripes, so neighbouring
+ * stripes run on the same CPU unless stolen. done() may run before
+ * pool_submit() returns.
+ */
+void pool_submit(struct pool *pool, struct pool_job *job)
+{
+	struct pool_task task = { .job = job };
+	int pushed = 0;
+	unsigned int s;
+
+	job->pending = job->stripes;
+	__atomic_add_fetch(&pool->stripes, job->stripes, __ATOMIC_RELAXED);
+
+	for (s = 0; s < job->stripes; s++) {
+		task.stripe = s;
+		/* Only if the queue is full, which shouldn't happen */
+		if (!queue_push(&pool->queues[s * pool->count / job->stripes], &task))
+			run_task(&task);
+		else
+			pushed++;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->queued, pushed, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_print(struct pool *pool)
+{
+	printf("pool: %d workers, %lu stripes, %lu stolen\n", pool->count,
+		__atomic_load_n(&pool->stripes, __ATOMIC_RELAXED),
+		__atomic_load_n(&pool->steals, __ATOMIC_RELAXED));
+}
+
+/* Waits for the queued stripes to be done */
+void pool_destroy(struct pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->count; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	free(pool->queues);
+	free(pool->workers);
+	free(pool);
+}
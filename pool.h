@@ -0,0 +1,23 @@
+/*
+ * Persistent worker threads running jobs split in stripes. Each worker
+ * has its own queue of stripes and steals from the others once it runs
+ * dry, so a slow stripe doesn't hold the others back.
+ */
+struct pool;
+
+struct pool_job {
+	/* Called on a worker for each stripe, concurrently */
+	void (*run)(struct pool_job *job, unsigned int stripe);
+	/* Called once, on the worker finishing the last stripe */
+	void (*done)(struct pool_job *job);
+	unsigned int stripes;
+
+	/* Private */
+	unsigned int pending;
+};
+
+struct pool *pool_create(int count);
+int pool_size(struct pool *pool);
+void pool_submit(struct pool *pool, struct pool_job *job);
+void pool_print(struct pool *pool);
+void pool_destroy(struct pool *pool);
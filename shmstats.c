@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmstats.h"
+
+static void shmstats_name(char *name, size_t size, int pid)
+{
+	snprintf(name, size, SHMSTATS_NAME, pid);
+}
+
+/* Returns NULL if there is no shared memory, the pipelines run anyway */
+struct shmstats *shmstats_create(void)
+{
+	struct shmstats *s;
+	char name[64];
+	int fd;
+
+	shmstats_name(name, sizeof(name), getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("stats: cannot create %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(*s))) {
+		printf("stats: cannot size %s: %s\n", name, strerror(errno));
+		goto fail;
+	}
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (s == MAP_FAILED) {
+		printf("stats: cannot map %s: %s\n", name, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+
+	s->version = SHMSTATS_VERSION;
+	s->size = sizeof(*s);
+	s->pid = getpid();
+	/* Last, readers ignore the segment until then */
+	__atomic_store_n(&s->magic, SHMSTATS_MAGIC, __ATOMIC_RELEASE);
+	printf("stats: live in /dev/shm%s\n", name);
+	return s;
+
+fail:
+	close(fd);
+	shm_unlink(name);
+	return NULL;
+}
+
+void shmstats_destroy(struct shmstats *s)
+{
+	char name[64];
+
+	if (!s)
+		return;
+	shmstats_name(name, sizeof(name), s->pid);
+	shm_unlink(name);
+	munmap(s, sizeof(*s));
+}
+
+/* Maps the segment of pid read-only */
+struct shmstats *shmstats_open(int pid)
+{
+	struct shmstats *s;
+	struct stat st;
+	char name[64];
+	int fd;
+
+	shmstats_name(name, sizeof(name), pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*s)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return s == MAP_FAILED ? NULL : s;
+}
+
+/*
+ * Consistent copy of s. Returns -1 with errno EPROTO if the segment is
+ * not one this version understands, ESRCH if the writer died in the
+ * middle of an update, EAGAIN if it kept updating for too long.
+ */
+int shmstats_read(const struct shmstats *s, struct shmstats *copy)
+{
+	uint32_t seq;
+	int tries;
+
+	if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SHMSTATS_MAGIC ||
+	    s->version != SHMSTATS_VERSION) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	for (tries = 1; tries <= SHMSTATS_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1)) {
+			memcpy(copy, s, sizeof(*copy));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+				return 0;
+		}
+
+		/* An update takes microseconds, a dead writer never ends it */
+		if (!(tries % 1024) && kill(s->pid, 0) && errno == ESRCH)
+			return -1;
+		sched_yield();
+	}
+	errno = EAGAIN;
+	return -1;
+}
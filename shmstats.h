@@ -0,0 +1,102 @@
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdint.h>
+
+/*
+ * Live stats in a POSIX shared memory segment named after the pid, for
+ * v4l-drm-stat to read while the pipelines run. The display thread is
+ * the only writer: seq is odd while it writes, readers copy the segment
+ * until they see the same even seq before and after.
+ *
+ * Fields are only added at the end, size tells how far a segment goes.
+ * The version changes when the meaning of an existing field does.
+ */
+#define SHMSTATS_NAME		"/v4l-drm-stat.%d"
+#define SHMSTATS_MAGIC		0x54534456	/* "VDST" */
+#define SHMSTATS_VERSION	2
+
+/* Attempts of shmstats_read() at a consistent copy */
+#define SHMSTATS_READ_TRIES	(1 << 20)
+
+#define SHMSTATS_PIPELINES	4
+/* enum owner */
+#define SHMSTATS_OWNERS		5
+/* enum latency_span */
+#define SHMSTATS_LATENCIES	4
+
+/* Where a frame the sensor captured got lost, in pipeline order */
+enum shmstats_drop {
+	/* Gaps in the V4L2 sequence while buffers were queued */
+	SHMSTATS_DROP_SENSOR = 0,
+	/* Gaps after the last queued buffer was dequeued */
+	SHMSTATS_DROP_NO_BUFFER,
+	/* No scanout buffer free to convert into */
+	SHMSTATS_DROP_NO_SCANOUT,
+	/* Replaced by a newer frame in mailbox or immediate mode */
+	SHMSTATS_DROP_REPLACED,
+	SHMSTATS_DROP_COMMIT_FAILED,
+	SHMSTATS_DROP_COUNT
+};
+
+static const char * const shmstats_drop_names[SHMSTATS_DROP_COUNT] = {
+	[SHMSTATS_DROP_SENSOR]		= "sensor",
+	[SHMSTATS_DROP_NO_BUFFER]	= "no buffer",
+	[SHMSTATS_DROP_NO_SCANOUT]	= "no scanout",
+	[SHMSTATS_DROP_REPLACED]	= "replaced",
+	[SHMSTATS_DROP_COMMIT_FAILED]	= "commit failed",
+};
+
+struct shmstats_latency {
+	uint64_t count;
+	uint64_t p50_ns, p99_ns, max_ns;
+};
+
+struct shmstats_pipeline {
+	char device[32];
+	char present_mode[16];
+	uint32_t conn_id, crtc_id;
+	uint32_t width, height;
+
+	uint64_t captured, displayed;
+	uint64_t dropped[SHMSTATS_DROP_COUNT];
+	uint64_t commit_failures;
+	/* Vblanks a flip took after the first one it could have */
+	uint64_t vblank_misses;
+
+	/* Buffers per enum owner, and frames waiting for the display */
+	uint32_t owners[SHMSTATS_OWNERS];
+	uint32_t pending;
+
+	/* Refreshed every second */
+	struct shmstats_latency latency[SHMSTATS_LATENCIES];
+};
+
+struct shmstats {
+	uint32_t magic, version, size;
+	uint32_t seq;
+	int32_t pid;
+	uint32_t pipeline_count;
+	/* CLOCK_MONOTONIC */
+	uint64_t start_ns, update_ns;
+	uint64_t commits, flips;
+	struct shmstats_pipeline pipelines[SHMSTATS_PIPELINES];
+};
+
+struct shmstats *shmstats_create(void);
+void shmstats_destroy(struct shmstats *s);
+struct shmstats *shmstats_open(int pid);
+int shmstats_read(const struct shmstats *s, struct shmstats *copy);
+
+static inline void shmstats_begin(struct shmstats *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void shmstats_end(struct shmstats *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SHMSTATS_H */
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+
+/*
+ * Wait-free single-producer/single-consumer ring of pointers.
+ * Only the producer writes tail and only the consumer writes head,
+ * each on its own cache line. The release/acquire pairs order the
+ * slot accesses with the index updates, so whatever the producer
+ * wrote to an item before pushing it is visible to the consumer.
+ */
+struct spsc_ring {
+	void **slots;
+	unsigned int mask;
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+};
+
+static inline int spsc_init(struct spsc_ring *ring, unsigned int size)
+{
+	unsigned int pow2 = 1;
+
+	while (pow2 < size)
+		pow2 <<= 1;
+
+	ring->slots = calloc(pow2, sizeof(*ring->slots));
+	if (!ring->slots)
+		return -1;
+	ring->mask = pow2 - 1;
+	ring->head = ring->tail = 0;
+	return 0;
+}
+
+/* Producer side, returns 0 if the ring is full */
+static inline int spsc_push(struct spsc_ring *ring, void *item)
+{
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head > ring->mask)
+		return 0;
+
+	ring->slots[tail & ring->mask] = item;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Consumer side, returns NULL if the ring is empty */
+static inline void *spsc_pop(struct spsc_ring *ring)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	void *item;
+
+	if (head == tail)
+		return NULL;
+
+	item = ring->slots[head & ring->mask];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return item;
+}
@@ -0,0 +1,40 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "sync.h"
+
+int sw_sync_timeline_create(void)
+{
+	int fd;
+
+	fd = open(SW_SYNC_PATH, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		printf("SYNC: cannot open %s: %s\n", SW_SYNC_PATH, strerror(errno));
+	return fd;
+}
+
+int sw_sync_fence_create(int timeline_fd, const char *name, unsigned int value)
+{
+	struct sw_sync_create_fence_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.value = value;
+	snprintf(data.name, sizeof(data.name), "%s", name);
+
+	if (ioctl(timeline_fd, SW_SYNC_IOC_CREATE_FENCE, &data) < 0) {
+		printf("SYNC: failed to create fence: %s\n", strerror(errno));
+		return -1;
+	}
+	return data.fence;
+}
+
+int sw_sync_timeline_inc(int timeline_fd, unsigned int count)
+{
+	__u32 arg = count;
+
+	return ioctl(timeline_fd, SW_SYNC_IOC_INC, &arg);
+}
@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* sw_sync is debugfs-only and has no uapi header */
+#define SW_SYNC_PATH "/sys/kernel/debug/sync/sw_sync"
+
+struct sw_sync_create_fence_data {
+	__u32 value;
+	char name[32];
+	__s32 fence;
+};
+
+#define SW_SYNC_IOC_MAGIC	'W'
+#define SW_SYNC_IOC_CREATE_FENCE \
+	_IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC		_IOW(SW_SYNC_IOC_MAGIC, 1, __u32)
+
+int sw_sync_timeline_create(void);
+int sw_sync_fence_create(int timeline_fd, const char *name, unsigned int value);
+int sw_sync_timeline_inc(int timeline_fd, unsigned int count);
@@ -0,0 +1,169 @@
+/*
+ * Shows the live stats of a running test, read from its shared memory
+ * segment, see shmstats.h.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmstats.h"
+
+static const char * const owner_names[SHMSTATS_OWNERS] = {
+	"free", "drm", "v4l", "shared", "cpu"
+};
+
+static const char * const latency_names[SHMSTATS_LATENCIES] = {
+	"capture->dequeue", "dequeue->commit", "commit->flip", "capture->flip"
+};
+
+/* The pid of the first segment in /dev/shm whose process still runs */
+static int find_pid(void)
+{
+	struct dirent *d;
+	DIR *dir;
+	int pid = 0;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return 0;
+	while (!pid && (d = readdir(dir)))
+		if (sscanf(d->d_name, "v4l-drm-stat.%d", &pid) != 1 ||
+		    kill(pid, 0))
+			pid = 0;
+	closedir(dir);
+	return pid;
+}
+
+static double rate(uint64_t now, uint64_t before, uint64_t ns)
+{
+	return ns ? (now - before) * 1e9 / ns : 0.0;
+}
+
+static void show(const struct shmstats *s, const struct shmstats *prev)
+{
+	const struct shmstats_pipeline *p, *q;
+	uint64_t ns = s->update_ns - prev->update_ns;
+	uint64_t dropped, dropped_before;
+	unsigned int i, j;
+
+	printf("pid %d, up %.1f s, atomic: %llu commits for %llu flips\n",
+		s->pid, (s->update_ns - s->start_ns) / 1e9,
+		(unsigned long long)s->commits, (unsigned long long)s->flips);
+
+	for (i = 0; i < s->pipeline_count && i < SHMSTATS_PIPELINES; i++) {
+		p = &s->pipelines[i];
+		q = &prev->pipelines[i];
+		for (dropped = dropped_before = 0, j = 0; j < SHMSTATS_DROP_COUNT; j++) {
+			dropped += p->dropped[j];
+			dropped_before += q->dropped[j];
+		}
+
+		printf("pipeline %u: %s -> connector %u, %ux%u, %s\n", i,
+			p->device, p->conn_id, p->width, p->height,
+			p->present_mode);
+		printf("  fps: captured %.1f, displayed %.1f, dropped %.1f, vblanks missed %.1f\n",
+			rate(p->captured, q->captured, ns),
+			rate(p->displayed, q->displayed, ns),
+			rate(dropped, dropped_before, ns),
+			rate(p->vblank_misses, q->vblank_misses, ns));
+		printf("  frames: captured %llu, displayed %llu, dropped %llu (",
+			(unsigned long long)p->captured,
+			(unsigned long long)p->displayed,
+			(unsigned long long)dropped);
+		for (j = 0; j < SHMSTATS_DROP_COUNT; j++)
+			printf("%s%s %llu", j ? ", " : "", shmstats_drop_names[j],
+				(unsigned long long)p->dropped[j]);
+		printf(")\n");
+		printf("  commit failures %llu, vblank misses %llu\n",
+			(unsigned long long)p->commit_failures,
+			(unsigned long long)p->vblank_misses);
+		printf("  buffers:");
+		for (j = 0; j < SHMSTATS_OWNERS; j++)
+			printf(" %s %u", owner_names[j], p->owners[j]);
+		printf(", pending %u\n", p->pending);
+		for (j = 0; j < SHMSTATS_LATENCIES; j++)
+			printf("  %-18s n=%-8llu p50=%.1fms p99=%.1fms max=%.1fms\n",
+				latency_names[j],
+				(unsigned long long)p->latency[j].count,
+				p->latency[j].p50_ns / 1e6,
+				p->latency[j].p99_ns / 1e6,
+				p->latency[j].max_ns / 1e6);
+	}
+	fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-i ms] [-n count] [pid]\n", name);
+	fprintf(stderr, "  -i  interval between updates (default 1000)\n");
+	fprintf(stderr, "  -n  exit after that many updates (default: when the process does)\n");
+	fprintf(stderr, "  pid  of the test to watch (default: the first one running)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct shmstats *s, cur, prev;
+	struct timespec interval;
+	unsigned int interval_ms = 1000, count = 0, n;
+	int opt, pid;
+
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval_ms = atoi(optarg);
+			if (!interval_ms)
+				usage(argv[0]);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1)
+		usage(argv[0]);
+	pid = optind < argc ? atoi(argv[optind]) : find_pid();
+	if (pid <= 0) {
+		fprintf(stderr, "no running test found\n");
+		return EXIT_FAILURE;
+	}
+
+	s = shmstats_open(pid);
+	if (!s) {
+		fprintf(stderr, "cannot open the stats of %d: %s\n", pid,
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (shmstats_read(s, &prev)) {
+		fprintf(stderr, "stats of %d: %s\n", pid, errno == EPROTO ?
+			"unknown layout" : errno == ESRCH ? "stale" :
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	interval.tv_sec = interval_ms / 1000;
+	interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	for (n = 0; !count || n < count; n++) {
+		nanosleep(&interval, NULL);
+		if (kill(pid, 0) && errno == ESRCH) {
+			printf("process %d exited\n", pid);
+			break;
+		}
+		if (shmstats_read(s, &cur)) {
+			if (errno != ESRCH)
+				continue;
+			printf("process %d died while updating its stats\n", pid);
+			break;
+		}
+		show(&cur, &prev);
+		prev = cur;
+	}
+	return 0;
+}
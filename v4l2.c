@@ -13,14 +13,17 @@
 #include <sys/ioctl.h>
 #include <poll.h>
 #include <libv4l2.h>
+#include <linux/sync_file.h>
 
 #include "videodev2.h"
 #include "v4l2.h"
+#include "devops.h"
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define PCLEAR(x) memset(x, 0, sizeof(*x))
 
-static enum v4l2_memory memory_type;
+/* DMABUF when importing DRM buffers, MMAP when exporting our own */
+static enum v4l2_memory memory_type = V4L2_MEMORY_DMABUF;
 
 void v4l2_queue_buffer(int fd, int index, int dmabuf_fd, int type)
 {
@@ -29,12 +32,48 @@ void v4l2_queue_buffer(int fd, int index, int dmabuf_fd, int type)
 	CLEAR(buf);
 	buf.type = type;
 	buf.index = index;
-	buf.m.fd = dmabuf_fd;
-	buf.memory = V4L2_MEMORY_DMABUF;
-	if (-1 == ioctl(fd, VIDIOC_QBUF, &buf))
+	buf.memory = memory_type;
+	if (memory_type == V4L2_MEMORY_DMABUF)
+		buf.m.fd = dmabuf_fd;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_QBUF, &buf))
 		errno_print("VIDIOC_QBUF");
 }
 
+/*
+ * Queue a buffer asking the driver for an out-fence, signaled when
+ * the buffer is filled. Returns the fence fd, or -1 if the driver
+ * doesn't support explicit fences, which only out-of-tree kernels do:
+ * callers probe with the first buffer and stop asking after a -1.
+ */
+int v4l2_queue_buffer_fence(int fd, int index, int dmabuf_fd, int type)
+{
+	struct sync_file_info info;
+	struct v4l2_buffer buf;
+
+	CLEAR(buf);
+	buf.type = type;
+	buf.index = index;
+	buf.memory = memory_type;
+	if (memory_type == V4L2_MEMORY_DMABUF)
+		buf.m.fd = dmabuf_fd;
+	buf.flags = V4L2_BUF_FLAG_OUT_FENCE;
+	buf.fence_fd = -1;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_QBUF, &buf)) {
+		errno_print("VIDIOC_QBUF");
+		return -1;
+	}
+
+	if (!(buf.flags & V4L2_BUF_FLAG_OUT_FENCE) || buf.fence_fd < 0)
+		return -1;
+
+	/* Whatever else a kernel left in the field isn't ours to use */
+	CLEAR(info);
+	if (ioctl(buf.fence_fd, SYNC_IOC_FILE_INFO, &info))
+		return -1;
+	return buf.fence_fd;
+}
+
+/* Returns 1 if a buffer was dequeued, 0 if none is ready, -1 on error */
 int v4l2_dequeue_buffer(int fd, struct v4l2_buffer *buf, int type)
 {	
 	PCLEAR(buf);
@@ -42,7 +81,7 @@ int v4l2_dequeue_buffer(int fd, struct v4l2_buffer *buf, int type)
 	buf->type = type;
 	buf->memory = memory_type;
 
-	if (-1 == ioctl(fd, VIDIOC_DQBUF, buf)) {
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_DQBUF, buf)) {
 		switch (errno) {
 		case EAGAIN:
 			return 0;
@@ -51,6 +90,7 @@ int v4l2_dequeue_buffer(int fd, struct v4l2_buffer *buf, int type)
 			/* fall through */
 		default:
 			errno_print("VIDIOC_DQBUF");
+			return -1;
 		}
 	}
 
@@ -60,17 +100,18 @@ int v4l2_dequeue_buffer(int fd, struct v4l2_buffer *buf, int type)
 void v4l2_stop(int fd, enum v4l2_buf_type type)
 {
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (-1 == ioctl(fd, VIDIOC_STREAMOFF, &type))
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_STREAMOFF, &type))
 		errno_print("VIDIOC_STREAMOFF");
 }
 
 void v4l2_start(int fd, enum v4l2_buf_type type)
 {
-	if (-1 == ioctl(fd, VIDIOC_STREAMON, &type))
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_STREAMON, &type))
 		errno_print("VIDIOC_STREAMON");
 }
 
-void v4l2_init_dmabuf(int fd, int count, int type, struct buffer *buffers)
+/* Returns the number of buffers the driver allocated, at most count */
+int v4l2_init_dmabuf(int fd, int count, int type, struct buffer *buffers)
 {
 	struct v4l2_requestbuffers req;
 	unsigned int i;
@@ -80,8 +121,9 @@ void v4l2_init_dmabuf(int fd, int count, int type, struct buffer *buffers)
 	req.count = count;
 	req.type = type;
 	req.memory = V4L2_MEMORY_DMABUF;
+	memory_type = V4L2_MEMORY_DMABUF;
 
-	if (-1 == ioctl(fd, VIDIOC_REQBUFS, &req)) {
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "does not support dmabuf\n");
 			exit(EXIT_FAILURE);
@@ -95,6 +137,12 @@ void v4l2_init_dmabuf(int fd, int count, int type, struct buffer *buffers)
 		exit(EXIT_FAILURE);
 	}
 
+	if (req.count > (unsigned int)count) {
+		fprintf(stderr, "Driver needs %u buffers, only %d available\n",
+			req.count, count);
+		exit(EXIT_FAILURE);
+	}
+
 	for (i = 0; i < req.count; ++i) {
 		struct v4l2_buffer buf;
 
@@ -104,13 +152,105 @@ void v4l2_init_dmabuf(int fd, int count, int type, struct buffer *buffers)
 		buf.memory      = V4L2_MEMORY_DMABUF;
 		buf.index       = i;
 
-		if (-1 == ioctl(fd, VIDIOC_QUERYBUF, &buf))
+		if (-1 == devops->v4l2_ioctl(fd, VIDIOC_QUERYBUF, &buf))
+			errno_print("VIDIOC_QUERYBUF");
+		buffers[i].v4l_index = buf.index;
+	}
+
+	return req.count;
+}
+
+/*
+ * Allocate count buffers in the driver, which knows the constraints
+ * of the capture hardware, and export each of them as a dmabuf for
+ * DRM to import. Returns the number of buffers.
+ */
+int v4l2_init_export(int fd, int count, int type, struct buffer *buffers)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_exportbuffer expbuf;
+	struct v4l2_buffer buf;
+	unsigned int i;
+
+	CLEAR(req);
+	req.count = count;
+	req.type = type;
+	req.memory = V4L2_MEMORY_MMAP;
+	memory_type = V4L2_MEMORY_MMAP;
+
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_REQBUFS, &req)) {
+		errno_print("VIDIOC_REQBUFS");
+		exit(EXIT_FAILURE);
+	}
+
+	if (req.count < 2) {
+		fprintf(stderr, "Insufficient buffer memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (req.count > (unsigned int)count) {
+		fprintf(stderr, "Driver needs %u buffers, only %d available\n",
+			req.count, count);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < req.count; ++i) {
+		CLEAR(buf);
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (-1 == devops->v4l2_ioctl(fd, VIDIOC_QUERYBUF, &buf)) {
 			errno_print("VIDIOC_QUERYBUF");
+			exit(EXIT_FAILURE);
+		}
+
+		CLEAR(expbuf);
+		expbuf.type = type;
+		expbuf.index = i;
+		expbuf.flags = O_CLOEXEC | O_RDWR;
+		if (-1 == devops->v4l2_ioctl(fd, VIDIOC_EXPBUF, &expbuf)) {
+			if (EINVAL == errno)
+				fprintf(stderr, "does not support exporting buffers\n");
+			else
+				errno_print("VIDIOC_EXPBUF");
+			exit(EXIT_FAILURE);
+		}
+
 		buffers[i].v4l_index = buf.index;
+		buffers[i].length = buf.length;
+		buffers[i].dmabuf_fd = expbuf.fd;
+		printf("V4L2 buffer exported as fd=%d\n", expbuf.fd);
+	}
+
+	return req.count;
+}
+
+/*
+ * Fill fourccs with the formats the device captures natively,
+ * returns how many.
+ */
+int v4l2_enum_formats(int fd, enum v4l2_buf_type type, uint32_t *fourccs, int max)
+{
+	struct v4l2_fmtdesc desc;
+	int count = 0;
+
+	CLEAR(desc);
+	desc.type = type;
+	while (count < max && devops->v4l2_ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0) {
+		/* Converted by the CPU, not what we want to scan out */
+		if (!(desc.flags & (V4L2_FMT_FLAG_COMPRESSED | V4L2_FMT_FLAG_EMULATED))) {
+			printf("v4l2 format: %.4s %s\n",
+				(char *)&desc.pixelformat, desc.description);
+			fourccs[count++] = desc.pixelformat;
+		}
+		desc.index++;
 	}
+	return count;
 }
 
-void v4l2_set_fmt(int fd, int width, int height, enum v4l2_buf_type type, int pixel_format)
+/* The format the driver settled on is returned in pix, if not NULL */
+void v4l2_set_fmt(int fd, int width, int height, enum v4l2_buf_type type,
+		int pixel_format, struct v4l2_pix_format *pix)
 {
 	struct v4l2_format fmt;
 
@@ -122,10 +262,181 @@ void v4l2_set_fmt(int fd, int width, int height, enum v4l2_buf_type type, int pi
 	fmt.fmt.pix.field       = V4L2_FIELD_NONE;
 	fmt.fmt.pix.colorspace  = V4L2_COLORSPACE_SRGB;
 
-	if (-1 == ioctl(fd, VIDIOC_S_FMT, &fmt))
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_S_FMT, &fmt))
 		errno_print("VIDIOC_S_FMT");
 
-	printf("v4l2 negotiated format for type %d: ", type);
+	printf("v4l2 negotiated format for type %d: %.4s, ", type,
+		(char *)&fmt.fmt.pix.pixelformat);
 	printf("size = %dx%d, ", fmt.fmt.pix.width, fmt.fmt.pix.height);
-	printf("pitch = %d bytes\n", fmt.fmt.pix.bytesperline);
+	printf("pitch = %d bytes, image size = %d bytes\n",
+		fmt.fmt.pix.bytesperline, fmt.fmt.pix.sizeimage);
+
+	if (pix)
+		*pix = fmt.fmt.pix;
+}
+
+/*
+ * Ask the driver to write pitch bytes per line, e.g. to match buffers
+ * allocated by someone else. Returns 0 if it accepted, -1 otherwise,
+ * pix is updated either way.
+ */
+int v4l2_set_pitch(int fd, enum v4l2_buf_type type,
+		struct v4l2_pix_format *pix, uint32_t pitch)
+{
+	struct v4l2_format fmt;
+
+	CLEAR(fmt);
+	fmt.type = type;
+	fmt.fmt.pix = *pix;
+	fmt.fmt.pix.bytesperline = pitch;
+	fmt.fmt.pix.sizeimage = 0;
+
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_S_FMT, &fmt)) {
+		errno_print("VIDIOC_S_FMT");
+		return -1;
+	}
+
+	*pix = fmt.fmt.pix;
+	printf("v4l2 pitch = %d bytes, image size = %d bytes\n",
+		pix->bytesperline, pix->sizeimage);
+	return pix->bytesperline == pitch ? 0 : -1;
+}
+
+void v4l2_get_fmt(int fd, enum v4l2_buf_type type, struct v4l2_pix_format *pix)
+{
+	struct v4l2_format fmt;
+
+	CLEAR(fmt);
+	fmt.type = type;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_G_FMT, &fmt))
+		errno_print("VIDIOC_G_FMT");
+	*pix = fmt.fmt.pix;
+}
+
+/*
+ * Selection rectangles: CROP is the area of the sensor captured,
+ * COMPOSE where it lands in the buffer, scaled if the sizes differ.
+ * Both return -1 if the driver has no such target.
+ */
+int v4l2_get_selection(int fd, enum v4l2_buf_type type, uint32_t target,
+		struct v4l2_rect *r)
+{
+	struct v4l2_selection sel;
+
+	CLEAR(sel);
+	sel.type = type;
+	sel.target = target;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_G_SELECTION, &sel))
+		return -1;
+	*r = sel.r;
+	return 0;
+}
+
+/* r is updated with what the driver picked, the closest it supports */
+int v4l2_set_selection(int fd, enum v4l2_buf_type type, uint32_t target,
+		struct v4l2_rect *r)
+{
+	struct v4l2_selection sel;
+
+	CLEAR(sel);
+	sel.type = type;
+	sel.target = target;
+	sel.r = *r;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_S_SELECTION, &sel)) {
+		errno_print("VIDIOC_S_SELECTION");
+		return -1;
+	}
+	*r = sel.r;
+	printf("v4l2 %s: %dx%d at %d,%d\n",
+		target == V4L2_SEL_TGT_CROP ? "crop" : "compose",
+		r->width, r->height, r->left, r->top);
+	return 0;
+}
+
+/*
+ * Round width x height up to the smallest frame size the device
+ * captures pixel_format at that covers it, or the largest one if none
+ * does. Returns -1, leaving the size alone, if sizes can't be listed.
+ */
+int v4l2_frame_size(int fd, uint32_t pixel_format, uint32_t *width,
+		uint32_t *height)
+{
+	struct v4l2_frmsizeenum fs;
+	uint32_t w, h, best_w = 0, best_h = 0, max_w = 0, max_h = 0;
+
+	CLEAR(fs);
+	fs.pixel_format = pixel_format;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fs))
+		return -1;
+
+	if (fs.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+		struct v4l2_frmsize_stepwise *s = &fs.stepwise;
+
+		w = *width < s->min_width ? s->min_width : *width;
+		h = *height < s->min_height ? s->min_height : *height;
+		if (s->step_width > 1)
+			w = s->min_width + (w - s->min_width + s->step_width - 1) /
+				s->step_width * s->step_width;
+		if (s->step_height > 1)
+			h = s->min_height + (h - s->min_height + s->step_height - 1) /
+				s->step_height * s->step_height;
+		*width = w < s->max_width ? w : s->max_width;
+		*height = h < s->max_height ? h : s->max_height;
+		return 0;
+	}
+
+	do {
+		w = fs.discrete.width;
+		h = fs.discrete.height;
+		if ((uint64_t)w * h > (uint64_t)max_w * max_h) {
+			max_w = w;
+			max_h = h;
+		}
+		if (w >= *width && h >= *height &&
+		    (!best_w || (uint64_t)w * h < (uint64_t)best_w * best_h)) {
+			best_w = w;
+			best_h = h;
+		}
+		fs.index++;
+	} while (devops->v4l2_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fs) == 0);
+
+	*width = best_w ? best_w : max_w;
+	*height = best_w ? best_h : max_h;
+	return 0;
+}
+
+/* Give every buffer back to the driver, e.g. before changing format */
+void v4l2_free_buffers(int fd, enum v4l2_buf_type type)
+{
+	struct v4l2_requestbuffers req;
+
+	CLEAR(req);
+	req.count = 0;
+	req.type = type;
+	req.memory = memory_type;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_REQBUFS, &req))
+		errno_print("VIDIOC_REQBUFS");
+}
+
+/* Source changes are signaled with POLLPRI */
+int v4l2_subscribe_source_change(int fd)
+{
+	struct v4l2_event_subscription sub;
+
+	CLEAR(sub);
+	sub.type = V4L2_EVENT_SOURCE_CHANGE;
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub)) {
+		printf("V4L2: no source change events\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns 1 if an event was dequeued, 0 if none is pending */
+int v4l2_dequeue_event(int fd, struct v4l2_event *ev)
+{
+	CLEAR(*ev);
+	if (-1 == devops->v4l2_ioctl(fd, VIDIOC_DQEVENT, ev))
+		return 0;
+	return 1;
 }
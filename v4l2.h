@@ -6,13 +6,18 @@
 #include <sys/ioctl.h>
 #include <libv4l2.h>
 #include "videodev2.h"
+#include "log.h"
 
 #define MAX_PLANES 3
 
 enum owner {
 	NO_OWNER = 0,
 	DRM_OWNED,
-	V4L_OWNED
+	V4L_OWNED,
+	/* Committed to DRM behind a capture fence, still queued in V4L */
+	SHARED_OWNED,
+	/* Being converted by the CPU */
+	CPU_OWNED
 };
 
 struct buffer {
@@ -25,22 +30,48 @@ struct buffer {
 	int fb_id;
 
 	enum owner owner;
+	/* Sized for the previous format, updated once DRM releases it */
+	int stale;
 	struct v4l2_plane planes[MAX_PLANES];
+
+	/* CLOCK_MONOTONIC timestamps of the frame in flight, 0 if unknown */
+	uint64_t capture_ns;
+	uint64_t dequeue_ns;
+	uint64_t commit_ns;
+	uint64_t flip_ns;
+	/* V4L2 sequence number of the frame */
+	uint32_t sequence;
 };
 
 inline static void errno_print(const char *s)
 {
-	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+	log_error("%s error %d, %m\n", s, errno);
 }
 
-void v4l2_init_dmabuf(int fd, int count, int type, struct buffer *buffers);
+int v4l2_init_dmabuf(int fd, int count, int type, struct buffer *buffers);
+int v4l2_init_export(int fd, int count, int type, struct buffer *buffers);
 void v4l2_uninit_device(struct buffer *buffers, int count);
 void v4l2_stop(int fd, enum v4l2_buf_type type);
 void v4l2_start(int fd, enum v4l2_buf_type type);
-void v4l2_set_fmt(int fd, int width, int height, enum v4l2_buf_type type, int pixel_format);
+void v4l2_set_fmt(int fd, int width, int height, enum v4l2_buf_type type,
+		int pixel_format, struct v4l2_pix_format *pix);
+void v4l2_free_buffers(int fd, enum v4l2_buf_type type);
+int v4l2_subscribe_source_change(int fd);
+int v4l2_dequeue_event(int fd, struct v4l2_event *ev);
+void v4l2_get_fmt(int fd, enum v4l2_buf_type type, struct v4l2_pix_format *pix);
+int v4l2_get_selection(int fd, enum v4l2_buf_type type, uint32_t target,
+		struct v4l2_rect *r);
+int v4l2_set_selection(int fd, enum v4l2_buf_type type, uint32_t target,
+		struct v4l2_rect *r);
+int v4l2_frame_size(int fd, uint32_t pixel_format, uint32_t *width,
+		uint32_t *height);
+int v4l2_set_pitch(int fd, enum v4l2_buf_type type,
+		struct v4l2_pix_format *pix, uint32_t pitch);
+int v4l2_enum_formats(int fd, enum v4l2_buf_type type, uint32_t *fourccs, int max);
 
 int v4l2_dequeue_buffer(int fd, struct v4l2_buffer *buf, int type);
 void v4l2_queue_buffer(int fd, int index, int dmabuf_fd, int type);
+int v4l2_queue_buffer_fence(int fd, int index, int dmabuf_fd, int type);
 
 static inline int v4l2_xioctl(int fh, int request, void *arg)
 {
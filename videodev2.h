@@ -913,6 +913,10 @@ struct v4l2_plane {
  * @length:	size in bytes of the buffer (NOT its payload) for single-plane
  *		buffers (when type != *_MPLANE); number of elements in the
  *		planes array for multi-plane buffers
+ * @fence_fd:	sync_file fd; with V4L2_BUF_FLAG_IN_FENCE the driver waits on
+ *		it before using the buffer, with V4L2_BUF_FLAG_OUT_FENCE the
+ *		driver returns a fence signaled when the buffer is filled.
+ *		Not mainline, see V4L2_BUF_FLAG_IN_FENCE
  *
  * Contains data exchanged by application and driver using one of the Streaming
  * I/O methods.
@@ -936,7 +940,10 @@ struct v4l2_buffer {
 		__s32		fd;
 	} m;
 	__u32			length;
-	__u32			reserved2;
+	union {
+		__s32		fence_fd;
+		__u32		reserved2;
+	};
 	__u32			reserved;
 };
 
@@ -973,6 +980,15 @@ struct v4l2_buffer {
 #define V4L2_BUF_FLAG_TSTAMP_SRC_SOE		0x00010000
 /* mem2mem encoder/decoder */
 #define V4L2_BUF_FLAG_LAST			0x00100000
+/*
+ * Explicit synchronization, from the V4L2 fences series that was posted
+ * upstream but never merged: only kernels carrying it know these flags
+ * and fence_fd. Mainline ignores them, hands back 0 in that field and
+ * may give the bits another meaning some day, so v4l2.c only trusts a
+ * fence the driver returned with the flag that really is a sync_file.
+ */
+#define V4L2_BUF_FLAG_IN_FENCE			0x00200000
+#define V4L2_BUF_FLAG_OUT_FENCE			0x00400000
 
 /**
  * struct v4l2_exportbuffer - export of video buffer as DMABUF file descriptor